@@ -0,0 +1,27 @@
+#!/bin/sh
+# Compiles each tests/NAME.wlp4 and runs it in the built-in simulator once per
+# line of NAME.runs, which holds the options for that run (--run=... and any
+# code generation switches). The output of all the runs, each after a
+# "# OPTIONS" line, has to match NAME.expected.
+#
+# Usage: tests/run.sh [WLP4GEN]    (./wlp4gen by default)
+
+compiler=${1:-./wlp4gen}
+dir=$(dirname "$0")
+status=0
+for program in "$dir"/*.wlp4; do
+    name=${program%.wlp4}
+    actual=$(while read -r options; do
+        echo "# $options"
+        # shellcheck disable=SC2086
+        "$compiler" $options "$program" 2>/dev/null || echo "FAILED"
+    done < "$name.runs")
+    if [ "$actual" = "$(cat "$name.expected")" ]; then
+        echo "ok $(basename "$name")"
+    else
+        echo "FAIL $(basename "$name")"
+        echo "$actual" | diff "$name.expected" - | head -20
+        status=1
+    fi
+done
+exit $status
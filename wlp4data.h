@@ -1,3 +1,4 @@
+#include<cstdint>
 #include<string>
 const std::string WLP4_CFG = R"END(.CFG
 start BOF procedures EOF
@@ -50,3 +51,58 @@ lvalue ID
 lvalue STAR factor
 lvalue LPAREN lvalue RPAREN
 )END";
+
+// Dense production IDs, one per rule of WLP4_CFG and in the same order.
+enum ProductionId : int16_t {
+    NO_PRODUCTION = -1,
+    START_BOF_PROCEDURES_EOF,
+    PROCEDURES_PROCEDURE_PROCEDURES,
+    PROCEDURES_MAIN,
+    PROCEDURE_INT_ID_LPAREN_PARAMS_RPAREN_LBRACE_DCLS_STATEMENTS_RETURN_EXPR_SEMI_RBRACE,
+    MAIN_INT_WAIN_LPAREN_DCL_COMMA_DCL_RPAREN_LBRACE_DCLS_STATEMENTS_RETURN_EXPR_SEMI_RBRACE,
+    PARAMS_EMPTY,
+    PARAMS_PARAMLIST,
+    PARAMLIST_DCL,
+    PARAMLIST_DCL_COMMA_PARAMLIST,
+    TYPE_INT,
+    TYPE_INT_STAR,
+    DCLS_EMPTY,
+    DCLS_DCLS_DCL_BECOMES_NUM_SEMI,
+    DCLS_DCLS_DCL_BECOMES_NULL_SEMI,
+    DCL_TYPE_ID,
+    STATEMENTS_EMPTY,
+    STATEMENTS_STATEMENTS_STATEMENT,
+    STATEMENT_LVALUE_BECOMES_EXPR_SEMI,
+    STATEMENT_IF_LPAREN_TEST_RPAREN_LBRACE_STATEMENTS_RBRACE_ELSE_LBRACE_STATEMENTS_RBRACE,
+    STATEMENT_WHILE_LPAREN_TEST_RPAREN_LBRACE_STATEMENTS_RBRACE,
+    STATEMENT_PRINTLN_LPAREN_EXPR_RPAREN_SEMI,
+    STATEMENT_DELETE_LBRACK_RBRACK_EXPR_SEMI,
+    TEST_EXPR_EQ_EXPR,
+    TEST_EXPR_NE_EXPR,
+    TEST_EXPR_LT_EXPR,
+    TEST_EXPR_LE_EXPR,
+    TEST_EXPR_GE_EXPR,
+    TEST_EXPR_GT_EXPR,
+    EXPR_TERM,
+    EXPR_EXPR_PLUS_TERM,
+    EXPR_EXPR_MINUS_TERM,
+    TERM_FACTOR,
+    TERM_TERM_STAR_FACTOR,
+    TERM_TERM_SLASH_FACTOR,
+    TERM_TERM_PCT_FACTOR,
+    FACTOR_ID,
+    FACTOR_NUM,
+    FACTOR_NULL,
+    FACTOR_LPAREN_EXPR_RPAREN,
+    FACTOR_AMP_LVALUE,
+    FACTOR_STAR_FACTOR,
+    FACTOR_NEW_INT_LBRACK_EXPR_RBRACK,
+    FACTOR_ID_LPAREN_RPAREN,
+    FACTOR_ID_LPAREN_ARGLIST_RPAREN,
+    ARGLIST_EXPR,
+    ARGLIST_EXPR_COMMA_ARGLIST,
+    LVALUE_ID,
+    LVALUE_STAR_FACTOR,
+    LVALUE_LPAREN_LVALUE_RPAREN,
+    NUM_PRODUCTIONS
+};
@@ -1,118 +1,568 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
 #include "wlp4data.h"
 
-typedef std::string Type;
-typedef std::string Symbol;
-typedef std::string TokenKind;
-typedef std::string TokenLexeme;
+// Command line switches
+struct Options {
+    bool peephole = true;
+    bool registerArgs = true;
+    bool licm = true;
+    size_t inlineBudget = 64;
+    size_t jobs = std::max(1u, std::thread::hardware_concurrency());
+    std::string cacheDir;
+    bool merl = false;
+    std::string stats;  // "", "text" or "json"
+    bool timeOutput = false;  // time the formatting of each instruction
+    bool nodeStats = false;  // count symbol table calls and time codeN
+} g_options;
+
+// Allocations made by the current thread. Counting is cheap enough to do
+// always, which also covers the tables built before main runs.
+thread_local uint64_t t_allocations = 0;
+thread_local uint64_t t_allocatedBytes = 0;
+
+void* operator new(size_t size) {
+    ++t_allocations;
+    t_allocatedBytes += size;
+    void* p = std::malloc(size > 0 ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+// Kept out of line, otherwise GCC sees free() on memory from operator new
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+// Phases of a compile reported by --stats. PROCEDURES is the time spent on
+// jobs summed over threads, and includes the symbol table work and codeN.
+enum Phase {
+    GRAMMAR, PARSE_TABLE, LOAD, SCAN, PARSE, TYPE_CHECK, ANNOTATE, INLINING, GENERATE, PROCEDURES,
+    OUTPUT, NUM_PHASES
+};
+
+const char* const PHASE_NAMES[] = {
+    "grammar", "parse table", "load", "scan", "parse", "type check", "annotate", "inlining", "generate",
+    "procedures", "output"
+};
+
+// SymbolTableStack methods, whose calls --stats counts. They are too short
+// to time one by one, so their time is only part of PROCEDURES.
+enum TableMethod {
+    TABLE_N_LOCALS, TABLE_PUSH, TABLE_POP, TABLE_INSERT_LOCAL, TABLE_INSERT_PARAMETER, TABLE_INSERT_REGISTER,
+    TABLE_GET_REGISTER, TABLE_GET_VARIABLE, TABLE_GET_TYPE, TABLE_GET_OFFSET, TABLE_INVERT_PARAM_OFFSETS,
+    TABLE_SET_FRAME, TABLE_GET_FRAME, NUM_TABLE_METHODS
+};
+
+const char* const TABLE_METHOD_NAMES[] = {
+    "nLocals", "push", "pop", "insertLocalVariable", "insertParameterVariable", "insertRegisterVariable",
+    "getRegister", "getVariable", "getType", "getOffset", "invertParamOffsets", "setFrame", "getFrame"
+};
+
+struct Counter {
+    uint64_t calls = 0;
+    uint64_t nanoseconds = 0;
+    uint64_t allocations = 0;
+    uint64_t bytes = 0;
+
+    Counter& operator+=(const Counter& other) {
+        this->calls += other.calls;
+        this->nanoseconds += other.nanoseconds;
+        this->allocations += other.allocations;
+        this->bytes += other.bytes;
+        return *this;
+    }
+};
+
+// What --stats reports. Each thread counts into its own t_stats, which
+// mergeStats() adds to g_stats.
+struct Stats {
+    Counter phases[NUM_PHASES];
+    Counter codeN[NUM_PRODUCTIONS];
+    uint64_t tableCalls[NUM_TABLE_METHODS] = {};
+    uint64_t nodes = 0;
+    uint64_t terminals = 0;
+
+    Stats& operator+=(const Stats& other) {
+        for (int i = 0; i < NUM_PHASES; ++i) {
+            this->phases[i] += other.phases[i];
+        }
+        for (int i = 0; i < NUM_PRODUCTIONS; ++i) {
+            this->codeN[i] += other.codeN[i];
+        }
+        for (int i = 0; i < NUM_TABLE_METHODS; ++i) {
+            this->tableCalls[i] += other.tableCalls[i];
+        }
+        this->nodes += other.nodes;
+        this->terminals += other.terminals;
+        return *this;
+    }
+};
+
+thread_local Stats t_stats;
+Stats g_stats;
+std::mutex g_statsLock;
+
+void mergeStats() {
+    std::lock_guard<std::mutex> guard(g_statsLock);
+    g_stats += t_stats;
+    t_stats = Stats();
+}
+
+// Charges the wall time and allocations of its scope to counter. Timers
+// that would run per node are only enabled with --stats.
+class Timer {
+    public:
+        explicit Timer(Counter& counter, bool enabled = true)
+        : counter(enabled ? &counter : nullptr) {
+            if (!this->counter) return;
+            this->allocations = t_allocations;
+            this->bytes = t_allocatedBytes;
+            this->start = std::chrono::steady_clock::now();
+        }
+
+        Timer(const Timer& other) = delete;
+        Timer& operator=(const Timer& other) = delete;
+
+        ~Timer() {
+            if (!this->counter) return;
+            auto elapsed = std::chrono::steady_clock::now() - this->start;
+            this->counter->calls++;
+            this->counter->nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+            this->counter->allocations += t_allocations - this->allocations;
+            this->counter->bytes += t_allocatedBytes - this->bytes;
+        }
+
+    private:
+        Counter* counter;
+        uint64_t allocations = 0;
+        uint64_t bytes = 0;
+        std::chrono::steady_clock::time_point start;
+};
+
+// Charges the time and allocations of codeN to the innermost production
+// being generated, so a node's counter leaves out its children and the
+// clock is read only once on the way into each node and once on the way out
+class NodeTimer {
+    public:
+        NodeTimer(ProductionId production, bool enabled): enabled(enabled) {
+            if (!this->enabled) return;
+            charge();
+            open.push_back(production);
+            t_stats.codeN[production].calls++;
+        }
+
+        NodeTimer(const NodeTimer& other) = delete;
+        NodeTimer& operator=(const NodeTimer& other) = delete;
+
+        ~NodeTimer() {
+            if (!this->enabled) return;
+            charge();
+            open.pop_back();
+        }
+
+    private:
+        // Charges everything since the last node was entered or left
+        static void charge() {
+            auto now = std::chrono::steady_clock::now();
+            if (!open.empty()) {
+                Counter& counter = t_stats.codeN[open.back()];
+                counter.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count();
+                counter.allocations += t_allocations - allocations;
+                counter.bytes += t_allocatedBytes - bytes;
+            }
+            last = now;
+            allocations = t_allocations;
+            bytes = t_allocatedBytes;
+        }
+
+        bool enabled;
+        static thread_local std::vector<ProductionId> open;
+        static thread_local std::chrono::steady_clock::time_point last;
+        static thread_local uint64_t allocations;
+        static thread_local uint64_t bytes;
+};
+
+thread_local std::vector<ProductionId> NodeTimer::open;
+thread_local std::chrono::steady_clock::time_point NodeTimer::last;
+thread_local uint64_t NodeTimer::allocations = 0;
+thread_local uint64_t NodeTimer::bytes = 0;
+
+typedef uint32_t StringId;
+
+// Grammar symbols, lexemes and identifiers are interned once while the tree
+// is loaded; everything after that passes around and compares StringIds.
+// g_strings is frozen once the tree is loaded, so code generation threads
+// read it without a lock. Labels go in a table per thread (see t_labels).
+class Interner {
+    public:
+        Interner() = default;
+
+        Interner(const Interner& other) = delete;
+        Interner& operator=(const Interner& other) = delete;
+
+        StringId intern(std::string_view s) {
+            auto it = this->ids.find(s);
+            if (it != this->ids.end()) return it->second;
+            if (this->frozen) {
+                std::cerr << "ERROR: cannot intern " << s << " after the tree is loaded" << std::endl;
+                throw std::exception();
+            }
+
+            // deque elements never move, so views of them stay valid
+            this->strings.emplace_back(s);
+            StringId id = this->strings.size() - 1;
+            this->ids.insert({this->strings.back(), id});
+            return id;
+        }
+
+        std::string_view str(StringId id) const {
+            return this->strings[id];
+        }
+
+        // Until trim(), only strings already interned can be looked up
+        void freeze() {
+            this->frozen = true;
+        }
+
+        // The strings interned so far are kept for good; trim() drops the
+        // ones that come after
+        void mark() {
+            this->marked = this->strings.size();
+        }
+
+        // Forgets everything interned since mark() and unfreezes. Only safe
+        // once no StringId or view of those strings is left, e.g. between
+        // compiles.
+        void trim() {
+            while (this->strings.size() > this->marked) {
+                this->ids.erase(this->strings.back());
+                this->strings.pop_back();
+            }
+            this->strings.shrink_to_fit();
+            this->frozen = false;
+        }
+
+        void clear() {
+            this->ids.clear();
+            this->strings.clear();
+        }
+
+    private:
+        std::deque<std::string> strings;
+        std::unordered_map<std::string_view, StringId> ids;
+        size_t marked = SIZE_MAX;
+        bool frozen = false;
+} g_strings;
+
+// Labels made by code generation. Every job clears its thread's table, so an
+// Instr's label only means something on the thread that made it, which is
+// also the one that prints it.
+thread_local Interner t_labels;
+
+typedef StringId Symbol;
+typedef StringId TokenKind;
+typedef StringId TokenLexeme;
+typedef StringId Identifier;
+
 typedef std::string Production;
-typedef std::string Register;
-typedef std::string Identifier;
+typedef int Register;
+
+enum Type : uint8_t {
+    NO_TYPE,
+    INT,
+    INT_STAR
+};
+
+Type parseType(std::string_view s) {
+    if (s == "int") return INT;
+    if (s == "int*") return INT_STAR;
+    std::cerr << "ERROR: unknown type " << s << std::endl;
+    throw std::exception();
+}
+
+const char* const TYPE_NAMES[] = {"", "int", "int*"};
 
-const Type INT = "int";
-const Type INT_STAR = "int*";
+const Symbol SYM_EMPTY = g_strings.intern(".EMPTY");
+const Symbol SYM_ID = g_strings.intern("ID");
+const Symbol SYM_NUM = g_strings.intern("NUM");
+const Symbol SYM_NULL = g_strings.intern("NULL");
+const Symbol SYM_EXPR = g_strings.intern("expr");
+const Symbol SYM_TERM = g_strings.intern("term");
+const Symbol SYM_FACTOR = g_strings.intern("factor");
 
-std::unordered_set<Production> loadProductions() {
+std::vector<Production> loadProductions() {
+    Timer timer(t_stats.phases[GRAMMAR]);
     std::stringstream ss(WLP4_CFG);
-    std::unordered_set<Production> productions;
+    std::vector<Production> productions;
     std::string line;
     getline(ss, line);  // discard ".CFG"
     while (getline(ss, line)) {
-        productions.insert(line);
+        productions.push_back(line);
+    }
+    if (productions.size() != NUM_PRODUCTIONS) {
+        std::cerr << "ERROR: ProductionId table does not match WLP4_CFG" << std::endl;
+        throw std::exception();
     }
     return productions;
 }
 
-const std::unordered_set<Production> WLP4_PRODUCTIONS = loadProductions();
+// Production strings indexed by ProductionId
+const std::vector<Production> WLP4_PRODUCTIONS = loadProductions();
 
-bool isProduction(std::string s) {
-    if (WLP4_PRODUCTIONS.find(s) != WLP4_PRODUCTIONS.end()) return true;
-    else return false;
+// Keys are views into WLP4_PRODUCTIONS, which is never modified
+std::unordered_map<std::string_view, ProductionId> loadProductionIds() {
+    Timer timer(t_stats.phases[GRAMMAR]);
+    std::unordered_map<std::string_view, ProductionId> ids;
+    for (size_t i = 0; i < WLP4_PRODUCTIONS.size(); ++i) {
+        ids.insert({WLP4_PRODUCTIONS[i], static_cast<ProductionId>(i)});
+    }
+    return ids;
 }
 
-std::vector<std::string> splitString(std::string s, std::string delim = " ") {
-    std::vector<std::string> parsed;
-    size_t pos = 0;
-    std::string token;
-    while ((pos = s.find(delim)) != std::string::npos) {
-        token = s.substr(0, pos);
-        parsed.push_back(token);
-        s.erase(0, pos + 1);
+const std::unordered_map<std::string_view, ProductionId> WLP4_PRODUCTION_IDS = loadProductionIds();
+
+// Left-hand side symbol of each production, indexed by ProductionId. The
+// right-hand side symbols are interned as well, so that every grammar symbol
+// is in g_strings before main marks it.
+std::vector<Symbol> loadProductionSymbols() {
+    Timer timer(t_stats.phases[GRAMMAR]);
+    std::vector<Symbol> symbols;
+    for (const Production& production : WLP4_PRODUCTIONS) {
+        std::string_view rule = production;
+        symbols.push_back(g_strings.intern(rule.substr(0, rule.find(' '))));
+        for (size_t start = rule.find(' '); start != std::string_view::npos; start = rule.find(' ', start + 1)) {
+            g_strings.intern(rule.substr(start + 1, rule.find(' ', start + 1) - start - 1));
+        }
     }
-    parsed.push_back(s);
-    return parsed;
+    return symbols;
 }
 
-std::string joinVector(const std::vector<std::string>& v, std::string sep = " ") {
-    std::string out = "";
-    for (std::string s : v) {
-        out += s;
-        out += sep;
+const std::vector<Symbol> WLP4_PRODUCTION_SYMBOLS = loadProductionSymbols();
+
+// Number of right-hand side symbols of each production, indexed by
+// ProductionId; 0 for .EMPTY rules
+std::vector<uint8_t> loadProductionSizes() {
+    Timer timer(t_stats.phases[GRAMMAR]);
+    std::vector<uint8_t> sizes;
+    for (const Production& production : WLP4_PRODUCTIONS) {
+        std::string_view rule = production;
+        uint8_t size = std::count(rule.begin(), rule.end(), ' ');
+        if (rule.substr(rule.find(' ') + 1) == ".EMPTY") size = 0;
+        sizes.push_back(size);
+    }
+    return sizes;
+}
+
+const std::vector<uint8_t> WLP4_PRODUCTION_SIZES = loadProductionSizes();
+
+ProductionId getProductionId(std::string_view s) {
+    auto it = WLP4_PRODUCTION_IDS.find(s);
+    if (it != WLP4_PRODUCTION_IDS.end()) return it->second;
+    else return NO_PRODUCTION;
+}
+
+// The whole compiler input, memory-mapped when it is a regular file and read
+// in one go otherwise (pipes, terminals). The tree loader tokenizes it in place
+// with std::string_views and only copies out the strings it interns.
+class InputBuffer {
+    public:
+        explicit InputBuffer(int fd) {
+            struct stat st;
+            if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+                void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapped != MAP_FAILED) {
+                    this->mapped = static_cast<const char*>(mapped);
+                    this->mappedSize = st.st_size;
+                    return;
+                }
+            }
+
+            char chunk[1 << 16];
+            ssize_t n;
+            while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+                this->contents.append(chunk, n);
+            }
+            if (n < 0) {
+                std::cerr << "ERROR: could not read input" << std::endl;
+                throw std::exception();
+            }
+        }
+
+        InputBuffer(const InputBuffer& other) = delete;
+        InputBuffer& operator=(const InputBuffer& other) = delete;
+
+        ~InputBuffer() {
+            if (this->mapped) munmap(const_cast<char*>(this->mapped), this->mappedSize);
+        }
+
+        std::string_view view() const {
+            if (this->mapped) return std::string_view(this->mapped, this->mappedSize);
+            return this->contents;
+        }
+
+    private:
+        const char* mapped = nullptr;
+        size_t mappedSize = 0;
+        std::string contents;
+};
+
+// Hands out the lines of a parse tree without copying them
+class LineReader {
+    public:
+        explicit LineReader(std::string_view input): input(input) {}
+
+        bool getline(std::string_view& line) {
+            while (this->pos < this->input.size()) {
+                size_t end = this->input.find('\n', this->pos);
+                if (end == std::string_view::npos) end = this->input.size();
+                line = this->input.substr(this->pos, end - this->pos);
+                this->pos = end + 1;
+                if (!line.empty()) return true;
+            }
+            return false;
+        }
+
+    private:
+        std::string_view input;
+        size_t pos = 0;
+};
+
+// Splits s on delim into tokens, reusing the storage tokens already has
+void splitString(std::string_view s, std::vector<std::string_view>& tokens, char delim = ' ') {
+    tokens.clear();
+    size_t pos;
+    while ((pos = s.find(delim)) != std::string_view::npos) {
+        if (pos > 0) tokens.push_back(s.substr(0, pos));
+        s.remove_prefix(pos + 1);
     }
-    if (out.size() > 0) out.pop_back();
-    return out;
+    if (!s.empty()) tokens.push_back(s);
 }
 
 struct Token {
     Token() = default;
     Token(TokenKind kind, TokenLexeme lexeme): kind(kind), lexeme(lexeme) {}
-    TokenKind kind;
-    TokenLexeme lexeme;
+    TokenKind kind = 0;
+    TokenLexeme lexeme = 0;
 };
 
-class TreeNode {
+typedef uint32_t NodeId;
+
+class TreeNode;
+class ByteReader;
+
+// Children of a node are stored contiguously in the node arena, so a node
+// only needs to remember where its block starts and how long it is.
+class ChildRange {
     public:
-        std::vector<TreeNode*> children;
+        class iterator {
+            public:
+                iterator(NodeId id): id(id) {}
 
-        TreeNode(Symbol symbol, Production production = "", Token token = Token())
-        : symbol(symbol)
-        , production(production)
-        , token(token) {}
+                TreeNode* operator*() const;
 
-        TreeNode(const TreeNode& other)
-        : symbol(other.symbol)
-        , production(other.production)
-        , token(other.token) {
-            for (TreeNode* child : this->children) {
-                delete child;
-            }
-            this->children.clear();
+                iterator& operator++() {
+                    ++this->id;
+                    return *this;
+                }
 
-            for (TreeNode* child : other.children) {
-                TreeNode* childCopy = new TreeNode(*child);
-                this->children.push_back(childCopy);
-            }
+                bool operator!=(const iterator& other) const {
+                    return this->id != other.id;
+                }
+
+            private:
+                NodeId id;
+        };
+
+        ChildRange(NodeId first = 0, uint32_t count = 0)
+        : first(first)
+        , count(count) {}
+
+        TreeNode* operator[](size_t i) const;
+
+        NodeId at(size_t i) const {
+            return this->first + i;
         }
 
-        ~TreeNode() {
-            for (TreeNode* child : this->children) {
-                delete child;
-            }
+        size_t size() const {
+            return this->count;
         }
 
-        TreeNode& operator=(TreeNode other) {
-            swap(*this, other);
-            return *this;
+        iterator begin() const {
+            return iterator(this->first);
         }
 
-        friend void swap(TreeNode& a, TreeNode& b) {
-            std::swap(a.symbol, b.symbol);
-            std::swap(a.production, b.production);
-            std::swap(a.token, b.token);
-            std::swap(a.children, b.children);
+        iterator end() const {
+            return iterator(this->first + this->count);
         }
 
-        friend TreeNode* loadParseTree(std::istream& stream);
+    private:
+        NodeId first;
+        uint32_t count;
+};
+
+class TreeNode {
+    public:
+        ChildRange children;
+
+        TreeNode()
+        : regNeed(0)
+        , hasCall(0)
+        , constant(0) {}
+
+        TreeNode(Symbol symbol, ProductionId production = NO_PRODUCTION, Token token = Token())
+        : symbol(symbol)
+        , lexeme(token.lexeme)
+        , production(production)
+        , regNeed(0)
+        , hasCall(0)
+        , constant(0) {}
+
+        friend void loadNode(LineReader& reader, std::vector<std::string_view>& parsedLine, NodeId id, ChildRange& children);
+        friend void loadBinaryNode(ByteReader& reader, const std::vector<StringId>& strings, NodeId id, ChildRange& children);
+        friend class TypeChecker;
 
         bool N() {
-            if (this->production != "") return true;
+            if (this->production != NO_PRODUCTION) return true;
             else return false;
         }
 
@@ -128,9 +578,45 @@ class TreeNode {
             return this->symbol;
         }
 
+        // Number of expression temporaries needed to evaluate this subtree
+        // without spilling (its Sethi-Ullman number)
+        unsigned getRegisterNeed() {
+            return this->regNeed;
+        }
+
+        // Whether evaluating this subtree calls a procedure or the runtime,
+        // so it cannot be reordered with its siblings
+        bool getHasCall() {
+            return this->hasCall;
+        }
+
+        void setRegisterNeed(unsigned need, bool hasCall) {
+            this->regNeed = need < 63 ? need : 63;
+            this->hasCall = hasCall;
+        }
+
+        // Whether this int expression or test always has the same value,
+        // see foldConstants
+        bool isConstant() {
+            return this->constant;
+        }
+
+        int32_t getValue() {
+            return this->value;
+        }
+
+        void setConstant(int32_t value) {
+            this->constant = true;
+            this->value = value;
+        }
+
         Production getProduction() {
+            return WLP4_PRODUCTIONS[this->getProductionId()];
+        }
+
+        ProductionId getProductionId() {
             if (!this->N()) {
-                std::cerr << "ERROR: called getProduction() on Terminal node" << std::endl;
+                std::cerr << "ERROR: called getProductionId() on Terminal node" << std::endl;
                 throw std::exception();
             }
             return this->production;
@@ -141,19 +627,28 @@ class TreeNode {
                 std::cerr << "ERROR: called getToken() on NonTerminal node" << std::endl;
                 throw std::exception();
             }
-            return this->token;
+            return Token(this->symbol, this->lexeme);
         }
 
+        // Both helpers walk the subtree in preorder with an explicit stack,
+        // since arglists and statement chains can be arbitrarily deep.
         std::vector<Token> getLeaves() {
             std::vector<Token> leaves;
-            for (TreeNode* child : this->children) {
+            std::vector<TreeNode*> stack;
+            for (size_t i = this->children.size(); i > 0; --i) {
+                stack.push_back(this->children[i - 1]);
+            }
+            while (!stack.empty()) {
+                TreeNode* child = stack.back();
+                stack.pop_back();
                 if (child->children.size() > 0) {
                     // Non-Leaf
-                    std::vector<Token> childLeaves = child->getLeaves();
-                    leaves.insert(leaves.end(), childLeaves.begin(), childLeaves.end());
+                    for (size_t i = child->children.size(); i > 0; --i) {
+                        stack.push_back(child->children[i - 1]);
+                    }
                 } else {
                     // Leaf
-                    if (child->getSymbol() == ".EMPTY") continue;
+                    if (child->getSymbol() == SYM_EMPTY) continue;
                     leaves.push_back(child->getToken());
                 }
             }
@@ -162,12 +657,19 @@ class TreeNode {
 
         std::vector<TreeNode*> getChildSymbolNodes(Symbol sym) {
             std::vector<TreeNode*> nodes;
-            for (TreeNode* child : this->children) {
+            std::vector<TreeNode*> stack;
+            for (size_t i = this->children.size(); i > 0; --i) {
+                stack.push_back(this->children[i - 1]);
+            }
+            while (!stack.empty()) {
+                TreeNode* child = stack.back();
+                stack.pop_back();
                 if (child->symbol == sym) {
                     nodes.push_back(child);
                 } else {
-                    std::vector<TreeNode*> childNodes = child->getChildSymbolNodes(sym);
-                    nodes.insert(nodes.end(), childNodes.begin(), childNodes.end());
+                    for (size_t i = child->children.size(); i > 0; --i) {
+                        stack.push_back(child->children[i - 1]);
+                    }
                 }
             }
             return nodes;
@@ -178,801 +680,4341 @@ class TreeNode {
             this->type = type;
         }
 
-        void addChild(TreeNode* child) {
-            this->children.push_back(child);
+        // A terminal's token kind is its symbol, so only the lexeme is kept
+        Symbol symbol = SYM_EMPTY;
+        TokenLexeme lexeme = 0;
+        ProductionId production = NO_PRODUCTION;
+        Type type = NO_TYPE;
+        uint8_t regNeed : 6;
+        uint8_t hasCall : 1;
+        uint8_t constant : 1;
+        int32_t value = 0;
+};
+
+// Every TreeNode of the parse tree lives in one contiguous buffer. Nodes are
+// addressed by NodeId while the tree is being built, since growing the buffer
+// invalidates TreeNode pointers; once loading is done pointers are stable.
+class NodeArena {
+    public:
+        NodeArena() = default;
+
+        TreeNode* at(NodeId id) {
+            return &this->nodes[id];
         }
 
-        Type type = "";
-        Symbol symbol;
-        Production production;
-        Token token;
-};
+        // Reserves n consecutive nodes and returns the id of the first one
+        NodeId allocate(size_t n) {
+            NodeId first = this->nodes.size();
+            this->nodes.resize(first + n);
+            return first;
+        }
 
-TreeNode* loadParseTree(std::istream& stream) {
-    std::string line;
-    if (!getline(stream, line)) {
+        size_t size() {
+            return this->nodes.size();
+        }
+
+        void clear() {
+            std::vector<TreeNode>().swap(this->nodes);
+        }
+
+        void swap(NodeArena& other) {
+            this->nodes.swap(other.nodes);
+        }
+
+    private:
+        std::vector<TreeNode> nodes;
+} g_arena;
+
+TreeNode* ChildRange::iterator::operator*() const {
+    return g_arena.at(this->id);
+}
+
+TreeNode* ChildRange::operator[](size_t i) const {
+    return g_arena.at(this->first + i);
+}
+
+// Reads one line of the tree into the arena slot id. For a non-terminal the
+// children's block is reserved (but not read) and returned in children.
+void loadNode(LineReader& reader, std::vector<std::string_view>& parsedLine, NodeId id, ChildRange& children) {
+    std::string_view line;
+    if (!reader.getline(line)) {
         std::cerr << "ERROR: malformed parse tree" << std::endl;
         throw std::exception();
     }
 
-    TreeNode* root;
-    std::vector<std::string> parsedLine = splitString(line);
+    splitString(line, parsedLine);
+    if (parsedLine.size() < 2) {
+        std::cerr << "ERROR: malformed parse tree line: " << line << std::endl;
+        throw std::exception();
+    }
 
     // Get type
-    Type type = "";
+    Type type = NO_TYPE;
     if (*(parsedLine.end() - 2) == ":") {
-        type = *(parsedLine.end() - 1);
-        parsedLine = std::vector<std::string>(parsedLine.begin(), parsedLine.end() - 2);
-        line = joinVector(parsedLine);
+        type = parseType(*(parsedLine.end() - 1));
+        line = line.substr(0, (parsedLine.end() - 2)->data() - line.data() - 1);
+        parsedLine.resize(parsedLine.size() - 2);
     }
 
-    if (isProduction(line)) {
-        // Non-Terminal Node
-        root = new TreeNode(parsedLine[0], line);
-        for (size_t i = 1; i < parsedLine.size(); ++i) {
-            if (parsedLine[i] == ".EMPTY") {
-                root->addChild(new TreeNode(".EMPTY"));
-                continue;
-            }
-            root->addChild(loadParseTree(stream));
+    TreeNode root;
+    ProductionId production = getProductionId(line);
+    if (production != NO_PRODUCTION) {
+        // Non-Terminal Node; reserve the children's block up front so that
+        // siblings stay contiguous.
+        uint32_t nChildren = parsedLine.size() - 1;
+        NodeId first = g_arena.allocate(nChildren);
+        root = TreeNode(WLP4_PRODUCTION_SYMBOLS[production], production);
+        root.children = ChildRange(first, nChildren);
+        if (parsedLine[1] == ".EMPTY") {
+            *g_arena.at(first) = TreeNode(SYM_EMPTY);
+        } else {
+            children = root.children;
         }
     } else {
         // Terminal Node
-        root = new TreeNode(parsedLine[0], "", Token(parsedLine[0], parsedLine[1]));
+        Symbol kind = g_strings.intern(parsedLine[0]);
+        root = TreeNode(kind, NO_PRODUCTION, Token(kind, g_strings.intern(parsedLine[1])));
     }
-
-    root->setType(type);
-    return root;
+    root.setType(type);
+    *g_arena.at(id) = root;
 }
 
-class SymbolTable {
-    public:
-        SymbolTable() = default;
+// The tree is stored in preorder, so nodes are read depth first with an
+// explicit stack of the child blocks still being filled. Left-recursive rules
+// like "statements statements statement" make the tree as deep as the program
+// is long, which rules out recursing per level. loadNode(id, children) fills
+// in node id and reports the children still to be read.
+template <typename LoadNode>
+TreeNode* loadPreorder(LoadNode loadNode) {
+    std::vector<std::pair<ChildRange, uint32_t>> pending;
 
-        size_t nLocals() {
-            return this->localCtr / 4;
-        }
+    NodeId id = g_arena.allocate(1);
+    while (true) {
+        ChildRange children;
+        loadNode(id, children);
+        if (children.size() > 0) pending.push_back({children, 0});
 
-        void insertLocalVariable(Identifier id, Type type) {
-            this->varTable.insert({id, {type, this->localCtr}});
-            this->localCtr -= 4;
+        while (!pending.empty() && pending.back().second == pending.back().first.size()) {
+            pending.pop_back();
         }
+        if (pending.empty()) break;
+        id = pending.back().first.at(pending.back().second++);
+    }
+    return g_arena.at(0);
+}
 
-        void insertParameterVariable(Identifier id, Type type) {
-            this->varTable.insert({id, {type, this->paramCtr}});
-            this->paramCtr += 4;
+TreeNode* loadParseTree(std::string_view input) {
+    LineReader reader(input);
+    std::vector<std::string_view> parsedLine;
+    return loadPreorder([&](NodeId id, ChildRange& children) {
+        loadNode(reader, parsedLine, id, children);
+    });
+}
+
+// The binary tree format starts with BINARY_TREE_MAGIC, followed by a table
+// of the strings used as token kinds and lexemes (a varint count, then each
+// as a varint length and its bytes), followed by the nodes in preorder. A
+// node is a varint tag, 0 for a terminal and ProductionId + 1 otherwise, and
+// a type byte; a terminal then has varint string indices of its kind and
+// lexeme. Children are not counted, since the production implies how many.
+// The magic has to change along with the ProductionId numbering.
+const std::string_view BINARY_TREE_MAGIC = "WLP4TREE1\n";
+
+class ByteReader {
+    public:
+        explicit ByteReader(std::string_view input): input(input) {}
+
+        uint8_t byte() {
+            if (this->pos >= this->input.size()) malformed();
+            return this->input[this->pos++];
         }
 
-        std::pair<Type, int> getVariable(Identifier id) {
-            if (this->varTable.find(id) == this->varTable.end()) {
-                std::cerr << "ERROR: Cannot get unknown variable " << id << std::endl;
-                throw std::exception();
+        uint64_t varint() {
+            uint64_t value = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                uint8_t b = this->byte();
+                value |= (uint64_t)(b & 0x7f) << shift;
+                if (!(b & 0x80)) return value;
             }
-            return this->varTable[id];
+            malformed();
         }
 
-        Type getType(Identifier id) {
-            return this->getVariable(id).first;
+        std::string_view bytes(uint64_t n) {
+            if (n > this->input.size() - this->pos) malformed();
+            std::string_view s = this->input.substr(this->pos, n);
+            this->pos += n;
+            return s;
         }
 
-        std::string getOffset(Identifier id) {
-            return std::to_string(this->getVariable(id).second);
+        bool done() const {
+            return this->pos == this->input.size();
         }
 
-        void invertParamOffsets() {
-            int nParams = 0;
-            for (auto& var : this->varTable) {
-                int offset = var.second.second;
-                if (offset > 0) nParams++;
-            }
-
-            int maxOffset = nParams*4;
-            for (auto& var : this->varTable) {
-                int offset = var.second.second;
-                if (offset > 0) {
-                    var.second.second = 4 + maxOffset - offset;
-                }
-            }
+        [[noreturn]] static void malformed() {
+            std::cerr << "ERROR: malformed binary parse tree" << std::endl;
+            throw std::exception();
         }
 
     private:
-        std::unordered_map<Identifier, std::pair<Type, int>> varTable;
-        int localCtr = 0;
-        int paramCtr = 4;
+        std::string_view input;
+        size_t pos = 0;
 };
 
-class SymbolTableStack {
-    public:
-        SymbolTableStack() = default;
+void loadBinaryNode(ByteReader& reader, const std::vector<StringId>& strings, NodeId id, ChildRange& children) {
+    uint64_t tag = reader.varint();
+    uint8_t type = reader.byte();
+    if (type > INT_STAR) ByteReader::malformed();
 
-        SymbolTable& current() {
-            if (this->s.size() == 0) {
-                std::cerr << "ERROR: Cannot peek empty SymbolTableStack." << std::endl;
-                throw std::exception();
-            }
-            return this->s.back();
+    TreeNode root;
+    if (tag == 0) {
+        uint64_t kind = reader.varint();
+        uint64_t lexeme = reader.varint();
+        if (kind >= strings.size() || lexeme >= strings.size()) ByteReader::malformed();
+        root = TreeNode(strings[kind], NO_PRODUCTION, Token(strings[kind], strings[lexeme]));
+    } else {
+        if (tag > NUM_PRODUCTIONS) ByteReader::malformed();
+        ProductionId production = static_cast<ProductionId>(tag - 1);
+        uint32_t nChildren = WLP4_PRODUCTION_SIZES[production];
+        NodeId first = g_arena.allocate(std::max(nChildren, 1u));
+        root = TreeNode(WLP4_PRODUCTION_SYMBOLS[production], production);
+        root.children = ChildRange(first, std::max(nChildren, 1u));
+        if (nChildren == 0) {
+            *g_arena.at(first) = TreeNode(SYM_EMPTY);
+        } else {
+            children = root.children;
         }
+    }
+    root.setType(static_cast<Type>(type));
+    *g_arena.at(id) = root;
+}
 
-        size_t nLocals() {
-            return this->s.back().nLocals();
+TreeNode* loadBinaryTree(std::string_view input) {
+    ByteReader reader(input.substr(BINARY_TREE_MAGIC.size()));
+    std::vector<StringId> strings(reader.varint());
+    for (StringId& id : strings) {
+        id = g_strings.intern(reader.bytes(reader.varint()));
+    }
+    return loadPreorder([&](NodeId id, ChildRange& children) {
+        loadBinaryNode(reader, strings, id, children);
+    });
+}
+
+// LALR(1) parse tables for WLP4_CFG. Grammar symbols are numbered terminals
+// first, with the end of input last among them, so a lookahead set fits in a
+// 64-bit mask. The tables are built on first use, since tree input never
+// needs them.
+class ParseTable {
+    public:
+        static const ParseTable& get() {
+            static const ParseTable table;
+            return table;
         }
 
-        void push() {
-            this->s.push_back(SymbolTable());
+        // A positive action shifts and goes to state action - 1, a negative
+        // one reduces by production -action - 1, and 0 is a parse error
+        int32_t action(uint32_t state, uint32_t terminal) const {
+            return this->actions[state * this->nTerminals + terminal];
         }
 
-        void pop() {
-            if (this->s.size() == 0) {
-                std::cerr << "ERROR: Cannot pop empty SymbolTableStack." << std::endl;
-                throw std::exception();
-            }
-            this->s.pop_back();
+        uint32_t gotoState(uint32_t state, ProductionId production) const {
+            return this->gotos[state * this->nSymbols + this->lhs[production]];
         }
 
-        void insertLocalVariable(Identifier id, Type type) {
-            this->current().insertLocalVariable(id, type);
+        uint32_t terminal(TokenKind kind) const {
+            return this->terminals.at(kind);
+        }
+
+        uint32_t end() const {
+            return this->nTerminals - 1;
+        }
+
+    private:
+        ParseTable();
+
+        static void conflict() {
+            std::cerr << "ERROR: WLP4_CFG is not LALR(1)" << std::endl;
+            throw std::exception();
+        }
+
+        uint32_t nTerminals = 0;
+        uint32_t nSymbols = 0;
+        std::unordered_map<TokenKind, uint32_t> terminals;
+        std::vector<uint32_t> lhs;
+        std::vector<int32_t> actions;
+        std::vector<uint32_t> gotos;
+};
+
+ParseTable::ParseTable() {
+    Timer timer(t_stats.phases[PARSE_TABLE]);
+    std::vector<std::vector<std::string_view>> rules;
+    std::unordered_set<std::string_view> nonterminals;
+    for (const Production& production : WLP4_PRODUCTIONS) {
+        std::vector<std::string_view> rule;
+        splitString(production, rule);
+        if (rule[1] == ".EMPTY") rule.pop_back();
+        nonterminals.insert(rule[0]);
+        rules.push_back(rule);
+    }
+
+    std::unordered_map<std::string_view, uint32_t> numbers;
+    for (const auto& rule : rules) {
+        for (size_t i = 1; i < rule.size(); ++i) {
+            if (nonterminals.count(rule[i]) || numbers.count(rule[i])) continue;
+            this->terminals.insert({g_strings.intern(rule[i]), numbers.size()});
+            numbers.insert({rule[i], numbers.size()});
+        }
+    }
+    this->nTerminals = numbers.size() + 1;
+    if (this->nTerminals > 64) conflict();
+    this->nSymbols = this->nTerminals;
+    for (const auto& rule : rules) {
+        if (numbers.insert({rule[0], this->nSymbols}).second) ++this->nSymbols;
+    }
+
+    std::vector<std::vector<uint32_t>> rhs;
+    std::vector<std::vector<uint32_t>> byLhs(this->nSymbols);
+    for (size_t p = 0; p < rules.size(); ++p) {
+        this->lhs.push_back(numbers[rules[p][0]]);
+        rhs.emplace_back();
+        for (size_t i = 1; i < rules[p].size(); ++i) {
+            rhs.back().push_back(numbers[rules[p][i]]);
+        }
+        byLhs[this->lhs[p]].push_back(p);
+    }
+
+    std::vector<uint64_t> first(this->nSymbols, 0);
+    std::vector<bool> nullable(this->nSymbols, false);
+    for (uint32_t t = 0; t < this->nTerminals; ++t) {
+        first[t] = 1ull << t;
+    }
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t p = 0; p < rhs.size(); ++p) {
+            uint64_t f = first[this->lhs[p]];
+            bool empty = true;
+            for (uint32_t symbol : rhs[p]) {
+                f |= first[symbol];
+                if (!nullable[symbol]) {
+                    empty = false;
+                    break;
+                }
+            }
+            if (f != first[this->lhs[p]] || (empty && !nullable[this->lhs[p]])) {
+                first[this->lhs[p]] = f;
+                nullable[this->lhs[p]] = nullable[this->lhs[p]] || empty;
+                changed = true;
+            }
+        }
+    }
+
+    // LR(0) states, identified by their sorted kernel items. An item is a
+    // production shifted left 8 bits plus the position of its dot.
+    auto symbolAfterDot = [&](uint32_t item) {
+        const std::vector<uint32_t>& symbols = rhs[item >> 8];
+        return (item & 0xff) < symbols.size() ? symbols[item & 0xff] : UINT32_MAX;
+    };
+    std::vector<std::vector<uint32_t>> kernels = {{START_BOF_PROCEDURES_EOF << 8}};
+    std::vector<std::vector<uint32_t>> closures;
+    std::map<std::vector<uint32_t>, uint32_t> states = {{kernels[0], 0}};
+    for (uint32_t s = 0; s < kernels.size(); ++s) {
+        std::vector<uint32_t> items = kernels[s];
+        std::vector<bool> expanded(this->nSymbols, false);
+        for (size_t i = 0; i < items.size(); ++i) {
+            uint32_t symbol = symbolAfterDot(items[i]);
+            if (symbol == UINT32_MAX || symbol < this->nTerminals || expanded[symbol]) continue;
+            expanded[symbol] = true;
+            for (uint32_t p : byLhs[symbol]) {
+                items.push_back(p << 8);
+            }
+        }
+
+        std::map<uint32_t, std::vector<uint32_t>> successors;
+        for (uint32_t item : items) {
+            uint32_t symbol = symbolAfterDot(item);
+            if (symbol != UINT32_MAX) successors[symbol].push_back(item + 1);
+        }
+        this->gotos.resize((s + 1) * this->nSymbols, UINT32_MAX);
+        for (auto& successor : successors) {
+            std::sort(successor.second.begin(), successor.second.end());
+            auto it = states.insert({successor.second, kernels.size()}).first;
+            if (it->second == kernels.size()) kernels.push_back(successor.second);
+            this->gotos[s * this->nSymbols + successor.first] = it->second;
+        }
+        closures.push_back(std::move(items));
+    }
+
+    // Lookaheads are propagated from each state's kernel through its closure
+    // and on to the kernels of its successors until nothing changes
+    std::vector<std::vector<uint64_t>> lookaheads;
+    for (const auto& kernel : kernels) {
+        lookaheads.emplace_back(kernel.size(), 0);
+    }
+    lookaheads[0][0] = 1ull << this->end();
+    std::vector<uint64_t> closureLookaheads;
+    auto close = [&](uint32_t s) {
+        const std::vector<uint32_t>& items = closures[s];
+        closureLookaheads.assign(items.size(), 0);
+        std::copy(lookaheads[s].begin(), lookaheads[s].end(), closureLookaheads.begin());
+        std::unordered_map<uint32_t, size_t> positions;
+        for (size_t i = kernels[s].size(); i < items.size(); ++i) {
+            positions.insert({items[i] >> 8, i});
+        }
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (size_t i = 0; i < items.size(); ++i) {
+                uint32_t symbol = symbolAfterDot(items[i]);
+                if (symbol == UINT32_MAX || symbol < this->nTerminals) continue;
+
+                const std::vector<uint32_t>& symbols = rhs[items[i] >> 8];
+                uint64_t follow = 0;
+                bool restNullable = true;
+                for (size_t j = (items[i] & 0xff) + 1; j < symbols.size() && restNullable; ++j) {
+                    follow |= first[symbols[j]];
+                    restNullable = nullable[symbols[j]];
+                }
+                if (restNullable) follow |= closureLookaheads[i];
+                for (uint32_t p : byLhs[symbol]) {
+                    uint64_t& la = closureLookaheads[positions[p]];
+                    if ((la | follow) != la) {
+                        la |= follow;
+                        changed = true;
+                    }
+                }
+            }
+        }
+    };
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (uint32_t s = 0; s < kernels.size(); ++s) {
+            close(s);
+            for (size_t i = 0; i < closures[s].size(); ++i) {
+                uint32_t item = closures[s][i];
+                uint32_t symbol = symbolAfterDot(item);
+                if (symbol == UINT32_MAX) continue;
+                uint32_t target = this->gotos[s * this->nSymbols + symbol];
+                const std::vector<uint32_t>& kernel = kernels[target];
+                size_t k = std::lower_bound(kernel.begin(), kernel.end(), item + 1) - kernel.begin();
+                uint64_t& la = lookaheads[target][k];
+                if ((la | closureLookaheads[i]) != la) {
+                    la |= closureLookaheads[i];
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    this->actions.assign(kernels.size() * this->nTerminals, 0);
+    auto setAction = [&](uint32_t s, uint32_t t, int32_t action) {
+        int32_t& entry = this->actions[s * this->nTerminals + t];
+        if (entry != 0 && entry != action) conflict();
+        entry = action;
+    };
+    for (uint32_t s = 0; s < kernels.size(); ++s) {
+        close(s);
+        for (size_t i = 0; i < closures[s].size(); ++i) {
+            uint32_t item = closures[s][i];
+            uint32_t symbol = symbolAfterDot(item);
+            if (symbol == UINT32_MAX) {
+                for (uint32_t t = 0; t < this->nTerminals; ++t) {
+                    if (closureLookaheads[i] >> t & 1) setAction(s, t, -static_cast<int32_t>(item >> 8) - 1);
+                }
+            } else if (symbol < this->nTerminals) {
+                setAction(s, symbol, this->gotos[s * this->nSymbols + symbol] + 1);
+            }
+        }
+    }
+}
+
+// A token of WLP4 source and the line it is on, for error messages
+struct SourceToken {
+    Token token;
+    uint32_t line;
+};
+
+const std::unordered_map<std::string_view, TokenKind> WLP4_KEYWORDS = {
+    {"int", g_strings.intern("INT")},
+    {"wain", g_strings.intern("WAIN")},
+    {"if", g_strings.intern("IF")},
+    {"else", g_strings.intern("ELSE")},
+    {"while", g_strings.intern("WHILE")},
+    {"println", g_strings.intern("PRINTLN")},
+    {"return", g_strings.intern("RETURN")},
+    {"NULL", SYM_NULL},
+    {"new", g_strings.intern("NEW")},
+    {"delete", g_strings.intern("DELETE")}
+};
+
+// Two-character operators come first so that they win over their prefixes
+const std::vector<std::pair<std::string_view, TokenKind>> WLP4_OPERATORS = {
+    {"==", g_strings.intern("EQ")},
+    {"!=", g_strings.intern("NE")},
+    {"<=", g_strings.intern("LE")},
+    {">=", g_strings.intern("GE")},
+    {"<", g_strings.intern("LT")},
+    {">", g_strings.intern("GT")},
+    {"=", g_strings.intern("BECOMES")},
+    {"(", g_strings.intern("LPAREN")},
+    {")", g_strings.intern("RPAREN")},
+    {"{", g_strings.intern("LBRACE")},
+    {"}", g_strings.intern("RBRACE")},
+    {"[", g_strings.intern("LBRACK")},
+    {"]", g_strings.intern("RBRACK")},
+    {"+", g_strings.intern("PLUS")},
+    {"-", g_strings.intern("MINUS")},
+    {"*", g_strings.intern("STAR")},
+    {"/", g_strings.intern("SLASH")},
+    {"%", g_strings.intern("PCT")},
+    {",", g_strings.intern("COMMA")},
+    {";", g_strings.intern("SEMI")},
+    {"&", g_strings.intern("AMP")}
+};
+
+// Splits WLP4 source into tokens by maximal munch, between BOF and EOF.
+// Numbers must fit in an int, and a number running into a letter or another
+// number (as in 12ab or 007) is rejected rather than split.
+std::vector<SourceToken> scanSource(std::string_view source) {
+    std::vector<SourceToken> tokens;
+    uint32_t line = 1;
+    auto add = [&](TokenKind kind, std::string_view lexeme) {
+        tokens.push_back({Token(kind, g_strings.intern(lexeme)), line});
+    };
+    auto alnum = [&](size_t pos) {
+        return pos < source.size() && std::isalnum(static_cast<unsigned char>(source[pos]));
+    };
+
+    add(g_strings.intern("BOF"), "BOF");
+    size_t pos = 0;
+    while (pos < source.size()) {
+        char c = source[pos];
+        if (c == '\n') ++line;
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            ++pos;
+            continue;
+        }
+        if (source.substr(pos, 2) == "//") {
+            pos = std::min(source.find('\n', pos), source.size());
+            continue;
+        }
+
+        size_t end = pos;
+        if (std::isalpha(static_cast<unsigned char>(c))) {
+            while (alnum(end)) ++end;
+            std::string_view word = source.substr(pos, end - pos);
+            auto keyword = WLP4_KEYWORDS.find(word);
+            add(keyword != WLP4_KEYWORDS.end() ? keyword->second : SYM_ID, word);
+        } else if (std::isdigit(static_cast<unsigned char>(c))) {
+            while (alnum(end)) ++end;
+            std::string_view num = source.substr(pos, end - pos);
+            bool digits = std::all_of(num.begin(), num.end(), [](char d) { return d >= '0' && d <= '9'; });
+            if (!digits || (num.size() > 1 && num[0] == '0') || num.size() > 10 ||
+                std::stoll(std::string(num)) > INT32_MAX) {
+                std::cerr << "ERROR: invalid number " << num << " on line " << line << std::endl;
+                throw std::exception();
+            }
+            add(SYM_NUM, num);
+        } else {
+            for (const auto& op : WLP4_OPERATORS) {
+                if (source.substr(pos, op.first.size()) == op.first) {
+                    end = pos + op.first.size();
+                    add(op.second, op.first);
+                    break;
+                }
+            }
+            if (end == pos) {
+                std::cerr << "ERROR: unexpected character '" << c << "' on line " << line << std::endl;
+                throw std::exception();
+            }
+        }
+        pos = end;
+    }
+    add(g_strings.intern("EOF"), "EOF");
+    return tokens;
+}
+
+// Parses scanned WLP4 source into the arena and returns the root's id. Nodes
+// are built bottom-up, so unlike a loaded tree children come before their
+// parent; see layOutPreorder.
+NodeId parseSource(const std::vector<SourceToken>& tokens) {
+    const ParseTable& table = ParseTable::get();
+    std::vector<std::pair<uint32_t, TreeNode>> stack = {{0, TreeNode()}};
+
+    size_t next = 0;
+    while (true) {
+        uint32_t terminal = next < tokens.size() ? table.terminal(tokens[next].token.kind) : table.end();
+        int32_t action = table.action(stack.back().first, terminal);
+        if (action > 0) {
+            Token token = tokens[next++].token;
+            stack.push_back({action - 1, TreeNode(token.kind, NO_PRODUCTION, token)});
+            continue;
+        }
+        if (action == 0) {
+            const SourceToken& at = tokens[std::min(next, tokens.size() - 1)];
+            std::cerr << "ERROR: parse error on line " << at.line << " at " << g_strings.str(at.token.lexeme) << std::endl;
+            throw std::exception();
+        }
+
+        ProductionId production = static_cast<ProductionId>(-action - 1);
+        uint32_t nChildren = WLP4_PRODUCTION_SIZES[production];
+        NodeId first = g_arena.allocate(std::max(nChildren, 1u));
+        for (uint32_t i = 0; i < nChildren; ++i) {
+            *g_arena.at(first + i) = stack[stack.size() - nChildren + i].second;
+        }
+        if (nChildren == 0) *g_arena.at(first) = TreeNode(SYM_EMPTY);
+        stack.resize(stack.size() - nChildren);
+
+        TreeNode node(WLP4_PRODUCTION_SYMBOLS[production], production);
+        node.children = ChildRange(first, std::max(nChildren, 1u));
+        if (production == START_BOF_PROCEDURES_EOF) {
+            NodeId root = g_arena.allocate(1);
+            *g_arena.at(root) = node;
+            return root;
+        }
+        stack.push_back({table.gotoState(stack.back().first, production), node});
+    }
+}
+
+// Moves a parsed tree into the layout the tree loaders produce, which
+// annotateTree relies on and which keeps the output identical to compiling
+// the equivalent tree file
+TreeNode* layOutPreorder(NodeId root) {
+    NodeArena parsed;
+    parsed.swap(g_arena);
+
+    std::vector<std::pair<NodeId, NodeId>> work = {{root, g_arena.allocate(1)}};
+    while (!work.empty()) {
+        NodeId from = work.back().first;
+        NodeId to = work.back().second;
+        work.pop_back();
+
+        TreeNode node = *parsed.at(from);
+        if (node.N()) {
+            ChildRange children = node.children;
+            node.children = ChildRange(g_arena.allocate(children.size()), children.size());
+            for (size_t i = children.size(); i > 0; --i) {
+                work.push_back({children.at(i - 1), node.children.at(i - 1)});
+            }
+        }
+        *g_arena.at(to) = node;
+    }
+    return g_arena.at(0);
+}
+
+// Checks the WLP4 typing rules and records the types of expressions,
+// lvalues, and the IDs, NUMs and NULLs in them and in declarations, as in a
+// typed tree file. Procedures may only call themselves and earlier ones.
+class TypeChecker {
+    public:
+        void check(TreeNode* root) {
+            TreeNode* procedures = root->children[1];
+            while (procedures->getProductionId() == PROCEDURES_PROCEDURE_PROCEDURES) {
+                this->checkProcedure(procedures->children[0]);
+                procedures = procedures->children[1];
+            }
+            this->checkProcedure(procedures->children[0]);
+        }
+
+    private:
+        void checkProcedure(TreeNode* procedure) {
+            this->variables.clear();
+            size_t first;
+            if (procedure->getProductionId() == MAIN_INT_WAIN_LPAREN_DCL_COMMA_DCL_RPAREN_LBRACE_DCLS_STATEMENTS_RETURN_EXPR_SEMI_RBRACE) {
+                this->name = "wain";
+                this->declare(procedure->children[3]);
+                if (this->declare(procedure->children[5]) != INT) this->error("second parameter must be an int");
+                first = 8;
+            } else {
+                Identifier name = procedure->children[1]->getToken().lexeme;
+                this->name = g_strings.str(name);
+                if (this->signatures.count(name)) this->error("procedure is already defined");
+                std::vector<Type>& signature = this->signatures[name];
+                TreeNode* params = procedure->children[3];
+                if (params->getProductionId() == PARAMS_PARAMLIST) {
+                    TreeNode* paramlist = params->children[0];
+                    while (true) {
+                        signature.push_back(this->declare(paramlist->children[0]));
+                        if (paramlist->getProductionId() == PARAMLIST_DCL) break;
+                        paramlist = paramlist->children[2];
+                    }
+                }
+                first = 6;
+            }
+
+            std::vector<TreeNode*> dcls;
+            for (TreeNode* node = procedure->children[first]; node->getProductionId() != DCLS_EMPTY; node = node->children[0]) {
+                dcls.push_back(node);
+            }
+            for (size_t i = dcls.size(); i > 0; --i) {
+                TreeNode* node = dcls[i - 1];
+                Type type = this->declare(node->children[1]);
+                TreeNode* value = node->children[3];
+                value->setType(node->getProductionId() == DCLS_DCLS_DCL_BECOMES_NUM_SEMI ? INT : INT_STAR);
+                if (value->getType() != type) this->error("initializer has the wrong type");
+            }
+
+            // Children have to be typed before their parents, and statement
+            // lists and expressions can be arbitrarily deep
+            std::vector<TreeNode*> nodes;
+            std::vector<TreeNode*> stack = {procedure->children[first + 3], procedure->children[first + 1]};
+            while (!stack.empty()) {
+                TreeNode* node = stack.back();
+                stack.pop_back();
+                if (node->T()) continue;
+                nodes.push_back(node);
+                for (size_t i = node->children.size(); i > 0; --i) {
+                    stack.push_back(node->children[i - 1]);
+                }
+            }
+            for (size_t i = nodes.size(); i > 0; --i) {
+                this->checkNode(nodes[i - 1]);
+            }
+            if (procedure->children[first + 3]->getType() != INT) this->error("return value must be an int");
+        }
+
+        Type declare(TreeNode* dcl) {
+            Type type = dcl->children[0]->getProductionId() == TYPE_INT_STAR ? INT_STAR : INT;
+            TreeNode* id = dcl->children[1];
+            id->setType(type);
+            if (!this->variables.insert({id->getToken().lexeme, type}).second) {
+                this->error("duplicate variable " + std::string(g_strings.str(id->getToken().lexeme)));
+            }
+            return type;
+        }
+
+        Type variable(TreeNode* id) {
+            auto it = this->variables.find(id->getToken().lexeme);
+            if (it == this->variables.end()) {
+                this->error("undeclared variable " + std::string(g_strings.str(id->getToken().lexeme)));
+            }
+            id->setType(it->second);
+            return it->second;
+        }
+
+        void checkCall(TreeNode* node) {
+            Identifier callee = node->children[0]->getToken().lexeme;
+            std::string calleeName(g_strings.str(callee));
+            if (this->variables.count(callee)) this->error(calleeName + " is a variable, not a procedure");
+            auto it = this->signatures.find(callee);
+            if (it == this->signatures.end()) this->error("undeclared procedure " + calleeName);
+
+            std::vector<Type> arguments;
+            if (node->getProductionId() == FACTOR_ID_LPAREN_ARGLIST_RPAREN) {
+                TreeNode* arglist = node->children[2];
+                while (true) {
+                    arguments.push_back(arglist->children[0]->getType());
+                    if (arglist->getProductionId() == ARGLIST_EXPR) break;
+                    arglist = arglist->children[2];
+                }
+            }
+            if (arguments != it->second) this->error("wrong arguments in call to " + calleeName);
+        }
+
+        void checkNode(TreeNode* node) {
+            auto type = [&](size_t i) {
+                return node->children[i]->getType();
+            };
+            switch (node->getProductionId()) {
+                case FACTOR_ID:
+                case LVALUE_ID:
+                    node->setType(this->variable(node->children[0]));
+                    break;
+                case FACTOR_NUM:
+                    node->children[0]->setType(INT);
+                    node->setType(INT);
+                    break;
+                case FACTOR_NULL:
+                    node->children[0]->setType(INT_STAR);
+                    node->setType(INT_STAR);
+                    break;
+                case EXPR_TERM:
+                case TERM_FACTOR:
+                    node->setType(type(0));
+                    break;
+                case FACTOR_LPAREN_EXPR_RPAREN:
+                case LVALUE_LPAREN_LVALUE_RPAREN:
+                    node->setType(type(1));
+                    break;
+                case FACTOR_AMP_LVALUE:
+                    if (type(1) != INT) this->error("& needs an int lvalue");
+                    node->setType(INT_STAR);
+                    break;
+                case FACTOR_STAR_FACTOR:
+                case LVALUE_STAR_FACTOR:
+                    if (type(1) != INT_STAR) this->error("* needs an int*");
+                    node->setType(INT);
+                    break;
+                case FACTOR_NEW_INT_LBRACK_EXPR_RBRACK:
+                    if (type(3) != INT) this->error("new needs an int size");
+                    node->setType(INT_STAR);
+                    break;
+                case FACTOR_ID_LPAREN_RPAREN:
+                case FACTOR_ID_LPAREN_ARGLIST_RPAREN:
+                    this->checkCall(node);
+                    node->setType(INT);
+                    break;
+                case EXPR_EXPR_PLUS_TERM:
+                    if (type(0) == INT_STAR && type(2) == INT_STAR) this->error("cannot add two int*s");
+                    node->setType(type(0) == INT && type(2) == INT ? INT : INT_STAR);
+                    break;
+                case EXPR_EXPR_MINUS_TERM:
+                    if (type(0) == INT && type(2) == INT_STAR) this->error("cannot subtract an int* from an int");
+                    node->setType(type(0) == type(2) ? INT : INT_STAR);
+                    break;
+                case TERM_TERM_STAR_FACTOR:
+                case TERM_TERM_SLASH_FACTOR:
+                case TERM_TERM_PCT_FACTOR:
+                    if (type(0) != INT || type(2) != INT) this->error("*, / and % need ints");
+                    node->setType(INT);
+                    break;
+                case TEST_EXPR_EQ_EXPR:
+                case TEST_EXPR_NE_EXPR:
+                case TEST_EXPR_LT_EXPR:
+                case TEST_EXPR_LE_EXPR:
+                case TEST_EXPR_GE_EXPR:
+                case TEST_EXPR_GT_EXPR:
+                    if (type(0) != type(2)) this->error("comparison of different types");
+                    break;
+                case STATEMENT_LVALUE_BECOMES_EXPR_SEMI:
+                    if (type(0) != type(2)) this->error("assignment of different types");
+                    break;
+                case STATEMENT_PRINTLN_LPAREN_EXPR_RPAREN_SEMI:
+                    if (type(2) != INT) this->error("println needs an int");
+                    break;
+                case STATEMENT_DELETE_LBRACK_RBRACK_EXPR_SEMI:
+                    if (type(3) != INT_STAR) this->error("delete needs an int*");
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        [[noreturn]] void error(const std::string& message) {
+            std::cerr << "ERROR: " << message << " in " << this->name << std::endl;
+            throw std::exception();
+        }
+
+        std::string name;
+        std::unordered_map<Identifier, Type> variables;
+        std::unordered_map<Identifier, std::vector<Type>> signatures;
+};
+
+TreeNode* loadSource(std::string_view source) {
+    std::vector<SourceToken> tokens;
+    {
+        Timer timer(t_stats.phases[SCAN]);
+        tokens = scanSource(source);
+    }
+    TreeNode* root;
+    {
+        Timer timer(t_stats.phases[PARSE]);
+        root = layOutPreorder(parseSource(tokens));
+    }
+    Timer timer(t_stats.phases[TYPE_CHECK]);
+    TypeChecker().check(root);
+    return root;
+}
+
+// Loads a tree in either format, or compiles WLP4 source up to a typed tree
+TreeNode* loadTree(std::string_view input) {
+    Timer timer(t_stats.phases[LOAD]);
+    if (input.substr(0, BINARY_TREE_MAGIC.size()) == BINARY_TREE_MAGIC) return loadBinaryTree(input);
+    if (input.substr(0, 6) == "start ") return loadParseTree(input);
+    return loadSource(input);
+}
+
+void writeVarint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+// Writes a loaded tree in the binary format
+void writeBinaryTree(TreeNode* root, std::ostream& output) {
+    std::string strings;
+    std::string nodes;
+    std::unordered_map<StringId, uint32_t> indices;
+    auto index = [&](StringId id) {
+        auto it = indices.find(id);
+        if (it != indices.end()) return it->second;
+        std::string_view s = g_strings.str(id);
+        writeVarint(strings, s.size());
+        strings.append(s);
+        uint32_t i = indices.size();
+        indices.insert({id, i});
+        return i;
+    };
+
+    std::vector<TreeNode*> work = {root};
+    while (!work.empty()) {
+        TreeNode* node = work.back();
+        work.pop_back();
+        if (node->T()) {
+            Token token = node->getToken();
+            writeVarint(nodes, 0);
+            nodes.push_back(node->getType());
+            writeVarint(nodes, index(token.kind));
+            writeVarint(nodes, index(token.lexeme));
+            continue;
+        }
+        writeVarint(nodes, node->getProductionId() + 1);
+        nodes.push_back(node->getType());
+        if (WLP4_PRODUCTION_SIZES[node->getProductionId()] == 0) continue;
+        for (size_t i = node->children.size(); i > 0; --i) {
+            work.push_back(node->children[i - 1]);
+        }
+    }
+
+    std::string header(BINARY_TREE_MAGIC);
+    writeVarint(header, indices.size());
+    output << header << strings << nodes;
+}
+
+// Writes a loaded tree in the text format loadParseTree reads
+void writeTextTree(TreeNode* root, std::ostream& output) {
+    std::string text;
+    std::vector<TreeNode*> work = {root};
+    while (!work.empty()) {
+        TreeNode* node = work.back();
+        work.pop_back();
+        if (node->T()) {
+            Token token = node->getToken();
+            text.append(g_strings.str(token.kind));
+            text.push_back(' ');
+            text.append(g_strings.str(token.lexeme));
+        } else {
+            text.append(WLP4_PRODUCTIONS[node->getProductionId()]);
+            if (WLP4_PRODUCTION_SIZES[node->getProductionId()] > 0) {
+                for (size_t i = node->children.size(); i > 0; --i) {
+                    work.push_back(node->children[i - 1]);
+                }
+            }
+        }
+        if (node->getType() != NO_TYPE) {
+            text.append(" : ");
+            text.append(TYPE_NAMES[node->getType()]);
+        }
+        text.push_back('\n');
+    }
+    output << text;
+}
+
+class SymbolTable {
+    public:
+        SymbolTable() = default;
+
+        size_t nLocals() {
+            return this->localCtr / 4;
+        }
+
+        // The register variables are addressed from, and how many words at
+        // the top of the frame hold saved registers rather than locals
+        void setFrame(Register frame, int savedWords) {
+            this->frame = frame;
+            this->localCtr = -4 * savedWords;
+        }
+
+        Register getFrame() {
+            return this->frame;
+        }
+
+        void insertLocalVariable(Identifier id, Type type) {
+            this->varTable.insert({id, {type, this->localCtr}});
+            this->localCtr -= 4;
+        }
+
+        void insertParameterVariable(Identifier id, Type type) {
+            this->varTable.insert({id, {type, this->paramCtr}});
+            this->paramCtr += 4;
+        }
+
+        // A variable that lives in reg for the whole procedure instead of
+        // in the frame
+        void insertRegisterVariable(Identifier id, Type type, Register reg) {
+            this->varTable.insert({id, {type, 0}});
+            this->regTable.insert({id, reg});
+        }
+
+        // The register holding a variable, or 0 if it is in memory
+        Register getRegister(Identifier id) {
+            auto it = this->regTable.find(id);
+            return it == this->regTable.end() ? 0 : it->second;
+        }
+
+        std::pair<Type, int> getVariable(Identifier id) {
+            if (this->varTable.find(id) == this->varTable.end()) {
+                std::cerr << "ERROR: Cannot get unknown variable " << g_strings.str(id) << std::endl;
+                throw std::exception();
+            }
+            return this->varTable[id];
+        }
+
+        Type getType(Identifier id) {
+            return this->getVariable(id).first;
+        }
+
+        int getOffset(Identifier id) {
+            return this->getVariable(id).second;
+        }
+
+        void invertParamOffsets() {
+            int nParams = 0;
+            for (auto& var : this->varTable) {
+                int offset = var.second.second;
+                if (offset > 0) nParams++;
+            }
+
+            int maxOffset = nParams*4;
+            for (auto& var : this->varTable) {
+                int offset = var.second.second;
+                if (offset > 0) {
+                    var.second.second = 4 + maxOffset - offset;
+                }
+            }
+        }
+
+    private:
+        std::unordered_map<Identifier, std::pair<Type, int>> varTable;
+        std::unordered_map<Identifier, Register> regTable;
+        Register frame = 29;
+        int localCtr = 0;
+        int paramCtr = 4;
+};
+
+class SymbolTableStack {
+    public:
+        SymbolTableStack() = default;
+
+        SymbolTable& current() {
+            if (this->s.size() == 0) {
+                std::cerr << "ERROR: Cannot peek empty SymbolTableStack." << std::endl;
+                throw std::exception();
+            }
+            return this->s.back();
+        }
+
+        size_t nLocals() {
+            this->count(TABLE_N_LOCALS);
+            return this->s.back().nLocals();
+        }
+
+        void push() {
+            this->count(TABLE_PUSH);
+            this->s.push_back(SymbolTable());
+        }
+
+        void pop() {
+            this->count(TABLE_POP);
+            if (this->s.size() == 0) {
+                std::cerr << "ERROR: Cannot pop empty SymbolTableStack." << std::endl;
+                throw std::exception();
+            }
+            this->s.pop_back();
+        }
+
+        void insertLocalVariable(Identifier id, Type type) {
+            this->count(TABLE_INSERT_LOCAL);
+            this->current().insertLocalVariable(id, type);
         }
 
         void insertParameterVariable(Identifier id, Type type) {
+            this->count(TABLE_INSERT_PARAMETER);
             this->current().insertParameterVariable(id, type);
         }
 
-        std::pair<Type, int> getVariable(Identifier id) {
-            return this->current().getVariable(id);
+        void insertRegisterVariable(Identifier id, Type type, Register reg) {
+            this->count(TABLE_INSERT_REGISTER);
+            this->current().insertRegisterVariable(id, type, reg);
+        }
+
+        Register getRegister(Identifier id) {
+            this->count(TABLE_GET_REGISTER);
+            return this->current().getRegister(id);
+        }
+
+        std::pair<Type, int> getVariable(Identifier id) {
+            this->count(TABLE_GET_VARIABLE);
+            return this->current().getVariable(id);
+        }
+
+        Type getType(Identifier id) {
+            this->count(TABLE_GET_TYPE);
+            return this->current().getType(id);
+        }
+
+        int getOffset(Identifier id) {
+            this->count(TABLE_GET_OFFSET);
+            return this->current().getOffset(id);
+        }
+
+        void invertParamOffsets() {
+            this->count(TABLE_INVERT_PARAM_OFFSETS);
+            this->current().invertParamOffsets();
+        }
+
+        void setFrame(Register frame, int savedWords) {
+            this->count(TABLE_SET_FRAME);
+            this->current().setFrame(frame, savedWords);
+        }
+
+        Register getFrame() {
+            this->count(TABLE_GET_FRAME);
+            return this->current().getFrame();
+        }
+    private:
+        void count(TableMethod method) {
+            if (g_options.nodeStats) ++t_stats.tableCalls[method];
+        }
+
+        std::deque<SymbolTable> s;
+};
+
+// Procedures are generated in parallel, so each thread has its own
+thread_local SymbolTableStack g_tables;
+
+enum Opcode : uint8_t {
+    ADD, SUB, MULT, DIV, MFHI, MFLO, LIS, LW, SW, SLT, SLTU, BEQ, BNE, JR, JALR,
+    WORD,  // .word imm, or .word label
+    LABEL  // label:
+};
+
+const char* const OPCODE_NAMES[] = {
+    "add", "sub", "mult", "div", "mfhi", "mflo", "lis", "lw", "sw", "slt", "sltu", "beq", "bne", "jr", "jalr",
+    ".word", ""
+};
+
+const StringId NO_LABEL = UINT32_MAX;
+
+// One generated instruction, label or .word. Code is generated as a list of
+// these rather than as text so it can still be rewritten (see Peephole)
+// before it is printed. lw and sw keep their value register in t and their
+// base in s, as in the machine encoding.
+struct Instr {
+    Opcode op;
+    uint8_t d = 0;
+    uint8_t s = 0;
+    uint8_t t = 0;
+    int32_t imm = 0;
+    StringId label = NO_LABEL;
+
+    void print(std::string& out) const {
+        auto reg = [&out](Register r) {
+            out += '$';
+            out += std::to_string(r);
+        };
+        auto target = [&]() {
+            if (this->label != NO_LABEL) out += t_labels.str(this->label);
+            else out += std::to_string(this->imm);
+        };
+
+        if (this->op == LABEL) {
+            out += t_labels.str(this->label);
+            out += ":\n";
+            return;
+        }
+        out += OPCODE_NAMES[this->op];
+        out += ' ';
+        switch (this->op) {
+            case ADD: case SUB: case SLT: case SLTU:
+                reg(this->d); out += ", "; reg(this->s); out += ", "; reg(this->t);
+                break;
+            case MULT: case DIV:
+                reg(this->s); out += ", "; reg(this->t);
+                break;
+            case MFHI: case MFLO: case LIS:
+                reg(this->d);
+                break;
+            case JR: case JALR:
+                reg(this->s);
+                break;
+            case LW: case SW:
+                reg(this->t); out += ", "; out += std::to_string(this->imm); out += '('; reg(this->s); out += ')';
+                break;
+            case BEQ: case BNE:
+                reg(this->s); out += ", "; reg(this->t); out += ", "; target();
+                break;
+            case WORD:
+                target();
+                break;
+            default:
+                break;
+        }
+        out += '\n';
+    }
+
+    // Appends the instruction as a record that read() turns back into it,
+    // for object code output (see writeMerl). Labels are kept by name, so
+    // records can be cached like text.
+    void write(std::string& out) const {
+        out.push_back(this->op);
+        out.push_back(this->d);
+        out.push_back(this->s);
+        out.push_back(this->t);
+        for (int i = 0; i < 4; ++i) {
+            out.push_back(static_cast<char>(static_cast<uint32_t>(this->imm) >> (8 * i)));
+        }
+        if (this->label == NO_LABEL) {
+            writeVarint(out, 0);
+        } else {
+            std::string_view name = t_labels.str(this->label);
+            writeVarint(out, name.size() + 1);
+            out.append(name);
+        }
+    }
+
+    // The label's name is returned in label rather than interned
+    static Instr read(ByteReader& reader, std::string_view& label) {
+        Instr instr;
+        instr.op = static_cast<Opcode>(reader.byte());
+        instr.d = reader.byte();
+        instr.s = reader.byte();
+        instr.t = reader.byte();
+        uint32_t imm = 0;
+        for (int i = 0; i < 4; ++i) {
+            imm |= static_cast<uint32_t>(reader.byte()) << (8 * i);
+        }
+        instr.imm = static_cast<int32_t>(imm);
+        uint64_t length = reader.varint();
+        label = length > 0 ? reader.bytes(length - 1) : std::string_view();
+        return instr;
+    }
+};
+
+// Instruction constructors, named and ordered like the assembly they print
+namespace mips {
+    Instr make(Opcode op, Register d, Register s, Register t, int imm = 0, StringId label = NO_LABEL) {
+        Instr instr;
+        instr.op = op;
+        instr.d = d;
+        instr.s = s;
+        instr.t = t;
+        instr.imm = imm;
+        instr.label = label;
+        return instr;
+    }
+
+    Instr add(Register d, Register s, Register t) { return make(ADD, d, s, t); }
+    Instr sub(Register d, Register s, Register t) { return make(SUB, d, s, t); }
+    Instr slt(Register d, Register s, Register t) { return make(SLT, d, s, t); }
+    Instr sltu(Register d, Register s, Register t) { return make(SLTU, d, s, t); }
+    Instr mult(Register s, Register t) { return make(MULT, 0, s, t); }
+    Instr div(Register s, Register t) { return make(DIV, 0, s, t); }
+    Instr mfhi(Register d) { return make(MFHI, d, 0, 0); }
+    Instr mflo(Register d) { return make(MFLO, d, 0, 0); }
+    Instr lis(Register d) { return make(LIS, d, 0, 0); }
+    Instr lw(Register t, int offset, Register s) { return make(LW, 0, s, t, offset); }
+    Instr sw(Register t, int offset, Register s) { return make(SW, 0, s, t, offset); }
+    Instr beq(Register s, Register t, int offset) { return make(BEQ, 0, s, t, offset); }
+    Instr beq(Register s, Register t, std::string_view label) { return make(BEQ, 0, s, t, 0, t_labels.intern(label)); }
+    Instr bne(Register s, Register t, int offset) { return make(BNE, 0, s, t, offset); }
+    Instr bne(Register s, Register t, std::string_view label) { return make(BNE, 0, s, t, 0, t_labels.intern(label)); }
+    Instr jr(Register s) { return make(JR, 0, s, 0); }
+    Instr jalr(Register s) { return make(JALR, 0, s, 0); }
+    Instr word(int value) { return make(WORD, 0, 0, 0, value); }
+    Instr word(std::string_view label) { return make(WORD, 0, 0, 0, 0, t_labels.intern(label)); }
+    Instr label(std::string_view name) { return make(LABEL, 0, 0, 0, 0, t_labels.intern(name)); }
+}
+
+std::vector<Instr> pop(Register reg) {
+    return {mips::add(30, 30, 4), mips::lw(reg, -4, 30)};
+}
+
+std::vector<Instr> push(Register reg) {
+    return {mips::sw(reg, -4, 30), mips::sub(30, 30, 4)};
+}
+
+// Labels are numbered per procedure and tagged with the procedure's name,
+// so a procedure's code does not depend on which thread generates it or on
+// the rest of the program, and can be cached
+thread_local std::string g_procedureName;
+thread_local unsigned long long labelCtr = 0;
+
+std::string newLabel(std::string_view kind) {
+    return "F" + std::string(kind) + g_procedureName + "n" + std::to_string(labelCtr++);
+}
+
+// Sink for generated assembly. Text is collected in a fixed-size buffer that
+// is written straight to the output stream whenever it fills up, so memory use
+// does not grow with the program. Without a stream, full buffers are kept as a
+// list of chunks instead (a simple rope) until writeTo() is called. With
+// --merl, instructions are collected as records (see Instr::write) in place
+// of their text.
+class Emitter {
+    public:
+        static const size_t CHUNK_SIZE = 1 << 16;
+
+        explicit Emitter(std::ostream* stream = nullptr): stream(stream) {
+            this->buffer.reserve(CHUNK_SIZE);
+        }
+
+        Emitter(const Emitter& other) = delete;
+        Emitter& operator=(const Emitter& other) = delete;
+
+        ~Emitter() {
+            this->flush();
+        }
+
+        Emitter& operator<<(std::string_view text) {
+            if (this->buffer.size() + text.size() > CHUNK_SIZE) this->spill();
+            this->buffer.append(text);
+            return *this;
+        }
+
+        Emitter& operator<<(const Instr& instr) {
+            {
+                Timer timer(t_stats.phases[OUTPUT], g_options.timeOutput);
+                this->line.clear();
+                if (g_options.merl) instr.write(this->line);
+                else instr.print(this->line);
+            }
+            return *this << this->line;
+        }
+
+        void flush() {
+            this->spill();
+            if (!this->stream) return;
+            Timer timer(t_stats.phases[OUTPUT]);
+            this->stream->flush();
+        }
+
+        // Moves the text collected by an Emitter without a stream to the end
+        void append(Emitter& other) {
+            other.spill();
+            for (const std::string& chunk : other.chunks) {
+                *this << chunk;
+            }
+            other.chunks.clear();
+        }
+
+        void writeTo(std::ostream& stream) {
+            for (const std::string& chunk : this->chunks) {
+                stream.write(chunk.data(), chunk.size());
+            }
+            stream.write(this->buffer.data(), this->buffer.size());
+        }
+
+    private:
+        void spill() {
+            if (this->buffer.empty()) return;
+            if (this->stream) {
+                Timer timer(t_stats.phases[OUTPUT]);
+                this->stream->write(this->buffer.data(), this->buffer.size());
+            } else {
+                this->chunks.push_back(std::move(this->buffer));
+                this->buffer = std::string();
+            }
+            this->buffer.clear();
+            this->buffer.reserve(CHUNK_SIZE);
+        }
+
+        std::ostream* stream;
+        std::string buffer;
+        std::string line;
+        std::vector<std::string> chunks;
+};
+
+// Peephole optimizer between code generation and the Emitter. Instructions
+// are held back until a procedure returns (jr $31) or a segment of SEGMENT_SIZE
+// has built up, then the segment is rewritten until no rule applies and
+// printed. Rules that delete a register write check it against liveness
+// computed over the segment; control leaving the segment is assumed to read
+// every register. Calls and returns follow the calling convention: a call
+// reads its target, the arguments in $1 and $2 and the registers every
+// procedure preserves ($4, $10, $11, $29, $30), and clobbers the rest; a
+// return reads the preserved registers, $3 and $31, and a tail call the
+// same as a call plus $31. The rules are:
+//  - a push immediately popped becomes a move (or nothing)
+//  - a load from the address just stored to or loaded from becomes a move
+//  - a value computed into a dead register and then moved is computed in place
+//  - lis $x / .word n / add $a, $b, $x / lw or sw k($a) becomes lw or sw
+//    n+k($b) when $x and $a are dead afterwards
+//  - moves of a register to itself and writes to dead registers are dropped
+class Peephole {
+    public:
+        static const size_t SEGMENT_SIZE = 1 << 14;
+
+        Peephole(Emitter& out, bool enabled): out(out), enabled(enabled) {}
+
+        Peephole(const Peephole& other) = delete;
+        Peephole& operator=(const Peephole& other) = delete;
+
+        ~Peephole() {
+            this->flush();
+        }
+
+        Peephole& operator<<(const Instr& instr) {
+            if (!this->enabled) {
+                this->out << instr;
+                return *this;
+            }
+
+            // Never cut between a lis and its .word, or inside a numeric branch
+            if (this->segment.size() >= SEGMENT_SIZE && this->pinnedWords == 0) this->flush();
+            this->segment.push_back(instr);
+            if (instr.op == LIS) {
+                this->pinnedWords = 1;
+            } else if ((instr.op == BEQ || instr.op == BNE) && instr.label == NO_LABEL && instr.imm > 0) {
+                this->pinnedWords = instr.imm;
+            } else if (this->pinnedWords > 0 && instr.op != LABEL) {
+                this->pinnedWords--;
+            }
+            if (instr.op == JR && instr.s == 31 && this->pinnedWords == 0) this->flush();
+            return *this;
+        }
+
+        void flush() {
+            if (this->segment.empty()) return;
+            while (this->rewrite()) {}
+            for (const Instr& instr : this->segment) {
+                this->out << instr;
+            }
+            this->segment.clear();
+        }
+
+    private:
+        static const uint32_t ALL_REGISTERS = UINT32_MAX;
+        static const uint32_t PRESERVED_REGISTERS =
+            1u << 4 | 1u << 10 | 1u << 11 | 1u << 29 | 1u << 30;
+
+        static uint32_t bit(Register r) {
+            return r == 0 ? 0 : 1u << r;
+        }
+
+        static bool isPush(const Instr& a, const Instr& b) {
+            return a.op == SW && a.s == 30 && a.imm == -4 &&
+                   b.op == SUB && b.d == 30 && b.s == 30 && b.t == 4;
+        }
+
+        static bool isPop(const Instr& a, const Instr& b) {
+            return a.op == ADD && a.d == 30 && a.s == 30 && a.t == 4 &&
+                   b.op == LW && b.s == 30 && b.imm == -4;
+        }
+
+        // Index of the instruction a numeric branch at i lands on, or the
+        // segment size if that is outside the segment
+        size_t branchTarget(size_t i) {
+            size_t n = this->segment.size();
+            long offset = this->segment[i].imm;
+            size_t j = i + 1;
+            if (offset >= 0) {
+                while (j < n && (offset > 0 || this->segment[j].op == LABEL)) {
+                    if (this->segment[j].op != LABEL) offset--;
+                    j++;
+                }
+                return j;
+            }
+            while (offset < 0) {
+                if (j == 0) return n;
+                j--;
+                if (this->segment[j].op != LABEL) offset++;
+            }
+            return j;
+        }
+
+        // Backwards liveness over the segment, one bit per register. Also
+        // pins every instruction a numeric branch jumps over, since removing
+        // one would move its target.
+        void analyze() {
+            size_t n = this->segment.size();
+            std::unordered_map<StringId, size_t> labels;
+            for (size_t i = 0; i < n; ++i) {
+                if (this->segment[i].op == LABEL) labels[this->segment[i].label] = i;
+            }
+
+            std::vector<std::pair<size_t, size_t>> successors(n, {n + 1, n + 1});
+            std::vector<uint32_t> uses(n, 0);
+            std::vector<uint32_t> defs(n, 0);
+            this->pinned.assign(n, false);
+            for (size_t i = 0; i < n; ++i) {
+                const Instr& instr = this->segment[i];
+                successors[i].first = i + 1;
+                switch (instr.op) {
+                    case ADD: case SUB: case SLT: case SLTU:
+                        uses[i] = bit(instr.s) | bit(instr.t);
+                        defs[i] = bit(instr.d);
+                        break;
+                    case MULT: case DIV:
+                        uses[i] = bit(instr.s) | bit(instr.t);
+                        break;
+                    case MFHI: case MFLO: case LIS:
+                        defs[i] = bit(instr.d);
+                        break;
+                    case LW:
+                        uses[i] = bit(instr.s);
+                        defs[i] = bit(instr.t);
+                        break;
+                    case SW:
+                        uses[i] = bit(instr.s) | bit(instr.t);
+                        break;
+                    case BEQ: case BNE: {
+                        uses[i] = bit(instr.s) | bit(instr.t);
+                        size_t target = n;
+                        if (instr.label != NO_LABEL) {
+                            auto it = labels.find(instr.label);
+                            if (it != labels.end()) target = it->second;
+                        } else {
+                            target = this->branchTarget(i);
+                            size_t from = std::min(i, target);
+                            size_t to = std::min(std::max(i, target), n - 1);
+                            for (size_t j = from; j <= to; ++j) this->pinned[j] = true;
+                        }
+                        if (instr.op == BEQ && instr.s == 0 && instr.t == 0) {
+                            successors[i].first = target;
+                        } else {
+                            successors[i].second = target;
+                        }
+                        break;
+                    }
+                    case JR:
+                        // A return reads the result, a tail call the arguments
+                        uses[i] = PRESERVED_REGISTERS | bit(31) | bit(instr.s);
+                        uses[i] |= instr.s == 31 ? bit(3) : bit(1) | bit(2);
+                        successors[i].first = n + 1;
+                        break;
+                    case JALR:
+                        uses[i] = PRESERVED_REGISTERS | bit(1) | bit(2) | bit(instr.s);
+                        defs[i] = ALL_REGISTERS & ~PRESERVED_REGISTERS;
+                        break;
+                    default:
+                        break;
+                }
+            }
+
+            // liveIn[n] is whatever follows the segment, liveIn[n + 1] is nowhere
+            std::vector<uint32_t> liveIn(n + 2, 0);
+            liveIn[n] = ALL_REGISTERS;
+            this->liveOut.assign(n, 0);
+            bool changed = true;
+            while (changed) {
+                changed = false;
+                for (size_t i = n; i-- > 0;) {
+                    uint32_t out = liveIn[successors[i].first] | liveIn[successors[i].second];
+                    uint32_t in = uses[i] | (out & ~defs[i]);
+                    if (out != this->liveOut[i] || in != liveIn[i]) {
+                        this->liveOut[i] = out;
+                        liveIn[i] = in;
+                        changed = true;
+                    }
+                }
+            }
+        }
+
+        // Whether the rules may replace instructions i to i+length-1
+        bool window(size_t i, size_t length) {
+            if (i + length > this->segment.size()) return false;
+            for (size_t j = i; j < i + length; ++j) {
+                if (this->pinned[j]) return false;
+            }
+            return true;
+        }
+
+        // Tries every rule at i. On a match, appends the replacement to
+        // result and returns how many instructions it replaces.
+        size_t match(size_t i, std::vector<Instr>& result) {
+            const Instr* w = &this->segment[i];
+
+            // push $r / pop $q
+            if (this->window(i, 4) && isPush(w[0], w[1]) && isPop(w[2], w[3])) {
+                if (w[0].t != w[3].t) result.push_back(mips::add(w[3].t, w[0].t, 0));
+                return 4;
+            }
+            if (this->window(i, 2) && w[0].op == SUB && w[0].d == 30 && w[0].s == 30 && w[0].t == 4 &&
+                w[1].op == ADD && w[1].d == 30 && w[1].s == 30 && w[1].t == 4) {
+                return 2;
+            }
+
+            // sw or lw $r, k($b) / lw $q, k($b)
+            if (this->window(i, 2) && w[1].op == LW && (w[0].op == SW || w[0].op == LW) &&
+                w[0].s == w[1].s && w[0].imm == w[1].imm && !(w[0].op == LW && w[0].t == w[0].s)) {
+                result.push_back(w[0]);
+                if (w[0].t != w[1].t) result.push_back(mips::add(w[1].t, w[0].t, 0));
+                return 2;
+            }
+
+            // lis $x / .word n / add $a, $b, $x / lw or sw $r, k($a)
+            if (this->window(i, 4) && w[0].op == LIS && w[1].op == WORD && w[1].label == NO_LABEL &&
+                w[2].op == ADD && (w[3].op == LW || w[3].op == SW) && w[3].s == w[2].d) {
+                Register x = w[0].d;
+                Register a = w[2].d;
+                Register b = w[2].t == x ? w[2].s : w[2].t;
+                long offset = (long)w[1].imm + w[3].imm;
+                uint32_t clobbered = bit(x) | bit(a);
+                if (w[3].op == LW) clobbered &= ~bit(w[3].t);
+                bool storesAddress = w[3].op == SW && (w[3].t == x || w[3].t == a);
+                if (x != 0 && a != 0 && (w[2].s == x) != (w[2].t == x) && b != x &&
+                    offset >= -32768 && offset <= 32767 && !storesAddress &&
+                    !(this->liveOut[i + 3] & clobbered)) {
+                    result.push_back(mips::make(w[3].op, 0, b, w[3].t, offset));
+                    return 4;
+                }
+            }
+
+            // a write to $x / add $y, $x, $0
+            if (this->window(i, 2) && w[1].op == ADD && w[1].t == 0 && w[1].d != 0 && w[1].d != w[1].s &&
+                !(this->liveOut[i + 1] & bit(w[1].s))) {
+                Instr retargeted = w[0];
+                switch (w[0].op) {
+                    case ADD: case SUB: case SLT: case SLTU: case MFHI: case MFLO:
+                        if (w[0].d != w[1].s) break;
+                        retargeted.d = w[1].d;
+                        result.push_back(retargeted);
+                        return 2;
+                    case LW:
+                        if (w[0].t != w[1].s) break;
+                        retargeted.t = w[1].d;
+                        result.push_back(retargeted);
+                        return 2;
+                    default:
+                        break;
+                }
+            }
+
+            // add $r, $r, $0
+            if (this->window(i, 1) && w[0].op == ADD && w[0].d == w[0].s && w[0].t == 0) {
+                return 1;
+            }
+
+            // writes to dead registers
+            if (this->window(i, 1) && w[0].d != 0 && !(this->liveOut[i] & bit(w[0].d))) {
+                switch (w[0].op) {
+                    case ADD: case SUB: case SLT: case SLTU: case MFHI: case MFLO:
+                        return 1;
+                    case LIS:
+                        if (this->window(i, 2) && w[1].op == WORD) return 2;
+                        break;
+                    default:
+                        break;
+                }
+            }
+            return 0;
+        }
+
+        // One pass of the rules over the segment; returns whether anything changed
+        bool rewrite() {
+            this->analyze();
+
+            std::vector<Instr> result;
+            result.reserve(this->segment.size());
+            bool changed = false;
+            size_t i = 0;
+            while (i < this->segment.size()) {
+                size_t replaced = this->match(i, result);
+                if (replaced > 0) {
+                    i += replaced;
+                    changed = true;
+                } else {
+                    result.push_back(this->segment[i++]);
+                }
+            }
+            this->segment.swap(result);
+            return changed;
+        }
+
+        Emitter& out;
+        bool enabled;
+        std::vector<Instr> segment;
+        std::vector<uint32_t> liveOut;
+        std::vector<bool> pinned;
+        long pinnedWords = 0;
+};
+
+// A unit of code generation work: generate code for a node, emit
+// instructions, or run a side effect (e.g. popping a symbol table) at that
+// point in the output.
+struct Step {
+    enum Kind { CODE, EMIT, RUN };
+
+    Kind kind;
+    TreeNode* node = nullptr;
+    int depth = 0;
+    std::vector<Instr> instrs;
+    std::function<void()> fn;
+};
+
+// Expression nodes are generated at a depth, see TEMPS
+Step code(TreeNode* root, int depth = 0) {
+    Step step;
+    step.kind = Step::CODE;
+    step.node = root;
+    step.depth = depth;
+    return step;
+}
+
+Step run(std::function<void()> fn) {
+    Step step;
+    step.kind = Step::RUN;
+    step.fn = fn;
+    return step;
+}
+
+// The steps a codeN/codeT handler produces for one node, in output order.
+// Children are not generated in place; they are scheduled with code(child)
+// and expanded later by generate().
+class Plan {
+    public:
+        Plan& operator+=(const Instr& instr) {
+            if (this->steps.empty() || this->steps.back().kind != Step::EMIT) {
+                Step step;
+                step.kind = Step::EMIT;
+                this->steps.push_back(step);
+            }
+            this->steps.back().instrs.push_back(instr);
+            return *this;
+        }
+
+        Plan& operator+=(const std::vector<Instr>& instrs) {
+            for (const Instr& instr : instrs) {
+                *this += instr;
+            }
+            return *this;
+        }
+
+        Plan& operator+=(Step step) {
+            this->steps.push_back(std::move(step));
+            return *this;
+        }
+
+        std::vector<Step> steps;
+};
+
+// Expression temporaries are allocated like a stack: an expression generated
+// at depth d leaves its value in TEMPS[d] and may clobber TEMPS[d] and up, but
+// nothing below. TEMPS[0] is $3, where statements expect their results. The
+// rest are registers the generator otherwise never touches; all of them are
+// caller-saved around procedure and runtime calls.
+const std::vector<Register> TEMPS = {
+    3, 8, 9, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28
+};
+const int NTEMPS = TEMPS.size();
+
+// Temporaries from g_tempLimit up hold loop invariants, see loopInvariants
+thread_local int g_tempLimit = NTEMPS;
+
+// Calls between procedures pass their last arguments in these registers and
+// the rest on the stack, see stackArgumentCount. Expressions never touch
+// them, but the runtime calls that new, delete and println make do.
+const std::vector<Register> ARGUMENT_REGISTERS = {1, 2};
+
+// How many of a call's n arguments are pushed on the stack. Those come
+// first, so arguments that have to be parked on the stack while later ones
+// make calls can be popped back off before the jalr.
+size_t stackArgumentCount(size_t n) {
+    if (!g_options.registerArgs) return n;
+    return n - std::min(n, ARGUMENT_REGISTERS.size());
+}
+
+int32_t wrap(int64_t value) {
+    return static_cast<int32_t>(static_cast<uint32_t>(value));
+}
+
+// Marks node constant when its value is known at compile time, computed with
+// the machine's wrapping 32-bit arithmetic from its (already folded) children.
+// A call-free operand times 0 or mod 1 folds to 0; division by zero and
+// INT_MIN / -1 are left for run time. Only ints are ever constant.
+void foldConstant(TreeNode* node, bool hasCall) {
+    ProductionId production = node->getProductionId();
+    switch (production) {
+        case FACTOR_NUM: {
+            std::string num(g_strings.str(node->children[0]->getToken().lexeme));
+            node->setConstant(wrap(std::stoll(num)));
+            return;
+        }
+        case EXPR_TERM:
+        case TERM_FACTOR:
+        case FACTOR_LPAREN_EXPR_RPAREN: {
+            TreeNode* inner = node->children[production == FACTOR_LPAREN_EXPR_RPAREN ? 1 : 0];
+            if (inner->isConstant()) node->setConstant(inner->getValue());
+            return;
+        }
+        case EXPR_EXPR_PLUS_TERM:
+        case EXPR_EXPR_MINUS_TERM:
+        case TERM_TERM_STAR_FACTOR:
+        case TERM_TERM_SLASH_FACTOR:
+        case TERM_TERM_PCT_FACTOR:
+        case TEST_EXPR_EQ_EXPR:
+        case TEST_EXPR_NE_EXPR:
+        case TEST_EXPR_LT_EXPR:
+        case TEST_EXPR_LE_EXPR:
+        case TEST_EXPR_GE_EXPR:
+        case TEST_EXPR_GT_EXPR:
+            break;
+        default:
+            return;
+    }
+
+    TreeNode* left = node->children[0];
+    TreeNode* right = node->children[2];
+    if (!hasCall) {
+        bool zero = (left->isConstant() && left->getValue() == 0) || (right->isConstant() && right->getValue() == 0);
+        if (production == TERM_TERM_STAR_FACTOR && zero) {
+            node->setConstant(0);
+            return;
+        }
+        if (production == TERM_TERM_PCT_FACTOR && right->isConstant() && right->getValue() == 1) {
+            node->setConstant(0);
+            return;
+        }
+    }
+    if (!left->isConstant() || !right->isConstant()) return;
+
+    int64_t a = left->getValue();
+    int64_t b = right->getValue();
+    switch (production) {
+        case EXPR_EXPR_PLUS_TERM: node->setConstant(wrap(a + b)); return;
+        case EXPR_EXPR_MINUS_TERM: node->setConstant(wrap(a - b)); return;
+        case TERM_TERM_STAR_FACTOR: node->setConstant(wrap(a * b)); return;
+        case TEST_EXPR_EQ_EXPR: node->setConstant(a == b); return;
+        case TEST_EXPR_NE_EXPR: node->setConstant(a != b); return;
+        case TEST_EXPR_LT_EXPR: node->setConstant(a < b); return;
+        case TEST_EXPR_LE_EXPR: node->setConstant(a <= b); return;
+        case TEST_EXPR_GE_EXPR: node->setConstant(a >= b); return;
+        case TEST_EXPR_GT_EXPR: node->setConstant(a > b); return;
+        default:
+            break;
+    }
+    if (b == 0 || (a == INT32_MIN && b == -1)) return;
+    if (production == TERM_TERM_SLASH_FACTOR) node->setConstant(wrap(a / b));
+    if (production == TERM_TERM_PCT_FACTOR) node->setConstant(wrap(a % b));
+}
+
+// Folds constants and computes the Sethi-Ullman number of every node.
+// Children always come after their parent in the arena, so scanning it
+// backwards visits them first.
+void annotateTree() {
+    Timer timer(t_stats.phases[ANNOTATE]);
+    for (NodeId id = g_arena.size(); id-- > 0;) {
+        TreeNode* node = g_arena.at(id);
+        if (node->T()) {
+            node->setRegisterNeed(1, false);
+            continue;
+        }
+
+        unsigned need = 1;
+        bool hasCall = false;
+        for (TreeNode* child : node->children) {
+            need = std::max(need, child->getRegisterNeed());
+            hasCall = hasCall || child->getHasCall();
+        }
+
+        switch (node->getProductionId()) {
+            case FACTOR_ID_LPAREN_RPAREN:
+            case FACTOR_ID_LPAREN_ARGLIST_RPAREN:
+                // Arguments start over at depth 0 after the live temporaries are saved
+                need = 1;
+                hasCall = true;
+                break;
+            case FACTOR_NEW_INT_LBRACK_EXPR_RBRACK:
+            case STATEMENT_PRINTLN_LPAREN_EXPR_RPAREN_SEMI:
+            case STATEMENT_DELETE_LBRACK_RBRACK_EXPR_SEMI:
+                hasCall = true;
+                break;
+            case STATEMENT_LVALUE_BECOMES_EXPR_SEMI:
+            case EXPR_EXPR_PLUS_TERM:
+            case EXPR_EXPR_MINUS_TERM:
+            case TERM_TERM_STAR_FACTOR:
+            case TERM_TERM_SLASH_FACTOR:
+            case TERM_TERM_PCT_FACTOR:
+            case TEST_EXPR_EQ_EXPR:
+            case TEST_EXPR_NE_EXPR:
+            case TEST_EXPR_LT_EXPR:
+            case TEST_EXPR_LE_EXPR:
+            case TEST_EXPR_GE_EXPR:
+            case TEST_EXPR_GT_EXPR: {
+                unsigned left = node->children[0]->getRegisterNeed();
+                unsigned right = node->children[2]->getRegisterNeed();
+                need = left == right ? left + 1 : std::max(left, right);
+                break;
+            }
+            default:
+                break;
+        }
+
+        foldConstant(node, hasCall);
+        if (node->isConstant()) need = 1;
+        node->setRegisterNeed(need, hasCall);
+    }
+}
+
+// The operand an expression reduces to under x+0, x-0, x*1 and x/1, or null
+TreeNode* identityOperand(TreeNode* node) {
+    auto is = [](TreeNode* operand, int32_t value) {
+        return operand->isConstant() && operand->getValue() == value;
+    };
+    switch (node->getProductionId()) {
+        case EXPR_EXPR_PLUS_TERM:
+            if (is(node->children[2], 0)) return node->children[0];
+            if (is(node->children[0], 0)) return node->children[2];
+            return nullptr;
+        case EXPR_EXPR_MINUS_TERM:
+            return is(node->children[2], 0) ? node->children[0] : nullptr;
+        case TERM_TERM_STAR_FACTOR:
+            if (is(node->children[2], 1)) return node->children[0];
+            if (is(node->children[0], 1)) return node->children[2];
+            return nullptr;
+        case TERM_TERM_SLASH_FACTOR:
+            return is(node->children[2], 1) ? node->children[0] : nullptr;
+        default:
+            return nullptr;
+    }
+}
+
+// Looks through expr -> term -> factor -> ( expr ) wrappers
+TreeNode* unwrap(TreeNode* node) {
+    while (true) {
+        ProductionId production = node->getProductionId();
+        if (production == EXPR_TERM || production == TERM_FACTOR) {
+            node = node->children[0];
+        } else if (production == FACTOR_LPAREN_EXPR_RPAREN) {
+            node = node->children[1];
+        } else {
+            return node;
+        }
+    }
+}
+
+// Splits an addition chain such as x * 4 + 8 - 2 or p + 1 + 2 into the part
+// that has to be computed and a constant byte offset added to it. Returns
+// node itself when there is nothing to split off.
+TreeNode* splitOffset(TreeNode* node, int32_t& offset) {
+    int64_t total = 0;
+    TreeNode* base = node;
+    while (true) {
+        ProductionId production = base->getProductionId();
+        if (production != EXPR_EXPR_PLUS_TERM && production != EXPR_EXPR_MINUS_TERM) break;
+        TreeNode* left = base->children[0];
+        TreeNode* right = base->children[2];
+        if (right->isConstant()) {
+            int64_t scale = left->getType() == INT_STAR ? 4 : 1;
+            total += (production == EXPR_EXPR_PLUS_TERM ? 1 : -1) * scale * right->getValue();
+            base = unwrap(left);
+        } else if (left->isConstant() && production == EXPR_EXPR_PLUS_TERM) {
+            int64_t scale = right->getType() == INT_STAR ? 4 : 1;
+            total += scale * left->getValue();
+            base = unwrap(right);
+        } else {
+            break;
+        }
+        total = wrap(total);
+    }
+    offset = total;
+    return base;
+}
+
+// What the inliner knows about a procedure
+struct ProcedureInfo {
+    TreeNode* node = nullptr;
+    size_t size = 0;   // nodes in its parse tree
+    size_t calls = 0;  // call sites
+    bool inlined = false;
+    uint64_t hash = 0;  // of its parse tree, only with a cache
+};
+
+std::unordered_map<Identifier, ProcedureInfo> g_procedures;
+
+// Two differently seeded 64-bit FNV-1a hashes, one to name a cache entry and one to
+// check it
+class Hasher {
+    public:
+        Hasher& add(uint64_t value) {
+            for (int i = 0; i < 8; ++i) {
+                this->addByte(value >> (8 * i));
+            }
+            return *this;
+        }
+
+        Hasher& add(std::string_view s) {
+            this->add(s.size());
+            for (char c : s) {
+                this->addByte(c);
+            }
+            return *this;
+        }
+
+        // Everything loadParseTree read for the subtree: productions, and
+        // the kind, lexeme and type of every token
+        Hasher& addTree(TreeNode* root) {
+            std::vector<TreeNode*> work = {root};
+            while (!work.empty()) {
+                TreeNode* node = work.back();
+                work.pop_back();
+                if (node->T()) {
+                    this->add(g_strings.str(node->getToken().kind));
+                    this->add(g_strings.str(node->getToken().lexeme));
+                    this->add(node->getType());
+                    continue;
+                }
+                this->add(node->getProductionId());
+                for (TreeNode* child : node->children) {
+                    work.push_back(child);
+                }
+            }
+            return *this;
+        }
+
+        uint64_t first = 0xcbf29ce484222325;
+        uint64_t second = 0x84222325cbf29ce4;
+
+    private:
+        void addByte(uint8_t byte) {
+            this->first = (this->first ^ byte) * 0x100000001b3;
+            this->second = (this->second ^ (byte + 0x5a)) * 0x100000001b3;
+        }
+};
+
+size_t subtreeSize(TreeNode* root) {
+    size_t size = 0;
+    std::vector<TreeNode*> work = {root};
+    while (!work.empty()) {
+        TreeNode* node = work.back();
+        work.pop_back();
+        size++;
+        if (node->T()) continue;
+        for (TreeNode* child : node->children) {
+            work.push_back(child);
+        }
+    }
+    return size;
+}
+
+// Picks the procedures whose calls are all replaced by their bodies: leaf
+// procedures that fit in the inline budget, or are only called from one
+// place. A leaf keeps its variables in $7 and $1/$2, which no caller needs
+// across a call, so its body works unchanged in place of the jalr. Inlined
+// procedures are not emitted on their own.
+void planInlining() {
+    Timer timer(t_stats.phases[INLINING]);
+    for (NodeId id = 0; id < g_arena.size(); ++id) {
+        TreeNode* node = g_arena.at(id);
+        if (node->T()) continue;
+        switch (node->getProductionId()) {
+            case PROCEDURE_INT_ID_LPAREN_PARAMS_RPAREN_LBRACE_DCLS_STATEMENTS_RETURN_EXPR_SEMI_RBRACE: {
+                ProcedureInfo& info = g_procedures[node->children[1]->getToken().lexeme];
+                info.node = node;
+                info.size = subtreeSize(node);
+                if (!g_options.cacheDir.empty()) info.hash = Hasher().addTree(node).first;
+                break;
+            }
+            case FACTOR_ID_LPAREN_RPAREN:
+            case FACTOR_ID_LPAREN_ARGLIST_RPAREN:
+                g_procedures[node->children[0]->getToken().lexeme].calls++;
+                break;
+            default:
+                break;
+        }
+    }
+
+    if (g_options.inlineBudget == 0) return;
+    for (auto& entry : g_procedures) {
+        ProcedureInfo& info = entry.second;
+        info.inlined = info.node && !info.node->getHasCall() && info.calls > 0 &&
+            (info.size <= g_options.inlineBudget || info.calls == 1);
+    }
+}
+
+// Variables whose address is taken somewhere under root, which have to be
+// kept in memory
+std::unordered_set<Identifier> addressTakenVariables(TreeNode* root) {
+    std::unordered_set<Identifier> ids;
+    std::vector<TreeNode*> work = {root};
+    while (!work.empty()) {
+        TreeNode* node = work.back();
+        work.pop_back();
+        if (node->T()) continue;
+        if (node->getProductionId() == FACTOR_AMP_LVALUE) {
+            TreeNode* lvalue = node->children[1];
+            while (lvalue->getProductionId() == LVALUE_LPAREN_LVALUE_RPAREN) {
+                lvalue = lvalue->children[1];
+            }
+            if (lvalue->getProductionId() == LVALUE_ID) ids.insert(lvalue->children[0]->getToken().lexeme);
+        }
+        for (TreeNode* child : node->children) {
+            work.push_back(child);
+        }
+    }
+    return ids;
+}
+
+// Schedules the evaluation of two operands at the given depth and returns the
+// registers that will hold the left and right values. When neither operand
+// makes a call they may be evaluated in either order, so the one needing more
+// temporaries goes first. The left value is spilled to the stack (and comes
+// back in $5) once the temporaries run out, or when the right operand makes a
+// call, which would have to save it anyway.
+std::pair<Register, Register> operands(Plan& out, TreeNode* left, TreeNode* right, int depth) {
+    if (depth + 1 >= g_tempLimit || right->getHasCall()) {
+        out += code(left, depth);
+        out += push(TEMPS[depth]);
+        out += code(right, depth);
+        out += pop(5);
+        return {5, TEMPS[depth]};
+    }
+    if (!left->getHasCall() && !right->getHasCall() &&
+        right->getRegisterNeed() > left->getRegisterNeed()) {
+        out += code(right, depth);
+        out += code(left, depth + 1);
+        return {TEMPS[depth + 1], TEMPS[depth]};
+    }
+    out += code(left, depth);
+    out += code(right, depth + 1);
+    return {TEMPS[depth], TEMPS[depth + 1]};
+}
+
+// Temporaries below depth are live across a call made at depth
+std::vector<Instr> saveTemps(int depth) {
+    std::vector<Instr> code;
+    for (int i = 0; i < depth; ++i) {
+        std::vector<Instr> save = push(TEMPS[i]);
+        code.insert(code.end(), save.begin(), save.end());
+    }
+    return code;
+}
+
+std::vector<Instr> restoreTemps(int depth) {
+    std::vector<Instr> code;
+    for (int i = depth; i > 0; --i) {
+        std::vector<Instr> restore = pop(TEMPS[i - 1]);
+        code.insert(code.end(), restore.begin(), restore.end());
+    }
+    return code;
+}
+
+// Longest add/sub sequence multiplyConstant uses in place of lis, mult and
+// mflo, which take 14 cycles
+const size_t MAX_CHAIN = 8;
+
+// Multiplies reg by value in place. The product is built from the value's
+// non-adjacent form (digits 0, 1 and -1), doubling once per digit and adding
+// or subtracting a copy of reg kept in scratch, so x * 4 is two adds and
+// x * 7 is x * 8 - x. A negative value needs no final negation, since its
+// leading digit is -1. Products are mod 2^32 like mult's.
+void multiplyConstant(Plan& out, Register reg, int32_t value, Register scratch = 5) {
+    struct Chain {
+        std::vector<int> digits;  // least significant first
+        size_t nonzero = 0;
+
+        size_t length() const {
+            if (this->digits.empty()) return 1;
+            return (this->nonzero > 1) + (this->digits.back() < 0) + this->digits.size() - 1 + this->nonzero - 1;
+        }
+    };
+    auto chain = [](uint32_t value) {
+        Chain chain;
+        for (uint64_t v = value; v != 0 && chain.digits.size() < 32; v >>= 1) {
+            int digit = 0;
+            if (v & 1) {
+                digit = (v & 3) == 3 ? -1 : 1;
+                v -= digit;
+            }
+            chain.digits.push_back(digit);
+        }
+        // A digit past bit 31 is a multiple of 2^32
+        while (!chain.digits.empty() && chain.digits.back() == 0) {
+            chain.digits.pop_back();
+        }
+        for (int digit : chain.digits) {
+            chain.nonzero += digit != 0;
+        }
+        return chain;
+    };
+
+    Chain best = chain(static_cast<uint32_t>(value));
+    if (best.length() > MAX_CHAIN) {
+        out += mips::lis(scratch);
+        out += mips::word(value);
+        out += mips::mult(reg, scratch);
+        out += mips::mflo(reg);
+        return;
+    }
+
+    if (best.digits.empty()) {
+        out += mips::add(reg, 0, 0);
+        return;
+    }
+    if (best.nonzero > 1) out += mips::add(scratch, reg, 0);
+    if (best.digits.back() < 0) out += mips::sub(reg, 0, reg);
+    for (size_t i = best.digits.size() - 1; i > 0; --i) {
+        out += mips::add(reg, reg, reg);
+        if (best.digits[i - 1] > 0) out += mips::add(reg, reg, scratch);
+        if (best.digits[i - 1] < 0) out += mips::sub(reg, reg, scratch);
+    }
+}
+
+// The k for which node is the constant 2^k or -2^k with 1 <= k <= 30, or 0
+int powerOfTwo(TreeNode* node) {
+    if (!node->isConstant()) return 0;
+    int64_t value = node->getValue();
+    if (value < 0) value = -value;
+    for (int k = 1; k <= 30; ++k) {
+        if (value == int64_t(1) << k) return k;
+    }
+    return 0;
+}
+
+// Divides reg by 2^k in place, rounding toward zero like div, using $5 and $6.
+// There are no shifts, so the floor of reg / 2^k is the high word of
+// reg * 2^(32-k), and 1 is added back when reg is negative and the low word,
+// the bits shifted out, is not 0. 2^31 is negative as a signed word, so for
+// k = 1 the high word of (reg - (reg > 0)) * -2^31 is the negated quotient.
+// A mult and a few adds take 20 cycles to div's 35.
+void dividePowerOfTwo(Plan& out, Register reg, int k) {
+    if (k == 1) {
+        out += mips::slt(6, 0, reg);
+        out += mips::sub(reg, reg, 6);
+        out += mips::lis(6);
+        out += mips::word(INT32_MIN);
+        out += mips::mult(reg, 6);
+        out += mips::mfhi(reg);
+        out += mips::sub(reg, 0, reg);
+        return;
+    }
+    out += mips::slt(5, reg, 0);
+    out += mips::lis(6);
+    out += mips::word(1 << (32 - k));
+    out += mips::mult(reg, 6);
+    out += mips::mfhi(reg);
+    out += mips::mflo(6);
+    out += mips::sltu(6, 0, 6);
+    out += mips::add(6, 6, 5);
+    out += mips::slt(6, 11, 6);
+    out += mips::add(reg, reg, 6);
+}
+
+// Schedules a test followed by a branch to label that is taken when the
+// test's outcome is jumpIf, and falls through otherwise. Tests only ever
+// control IF and WHILE, so they are never materialized as a 0/1 value.
+void branch(Plan& out, TreeNode* test, bool jumpIf, const std::string& label) {
+    TreeNode* e1 = test->children[0];
+    TreeNode* e2 = test->children[2];
+    ProductionId production = test->getProductionId();
+
+    auto regs = operands(out, e1, e2, 0);
+    Register a = regs.first;
+    Register b = regs.second;
+    if (production == TEST_EXPR_EQ_EXPR || production == TEST_EXPR_NE_EXPR) {
+        bool onEqual = (production == TEST_EXPR_EQ_EXPR) == jumpIf;
+        out += onEqual ? mips::beq(a, b, label) : mips::bne(a, b, label);
+        return;
+    }
+
+    // LT and GE look at a < b, GT and LE at b < a; LE and GE hold when it is false
+    bool swapped = production == TEST_EXPR_GT_EXPR || production == TEST_EXPR_LE_EXPR;
+    bool negated = production == TEST_EXPR_LE_EXPR || production == TEST_EXPR_GE_EXPR;
+    Register lhs = swapped ? b : a;
+    Register rhs = swapped ? a : b;
+    out += e1->getType() == INT_STAR ? mips::sltu(6, lhs, rhs) : mips::slt(6, lhs, rhs);
+    out += jumpIf != negated ? mips::bne(6, 0, label) : mips::beq(6, 0, label);
+}
+
+void codeT(TreeNode* root, int depth, Plan& out) {
+    Register dst = TEMPS[depth];
+    Symbol sym = root->getSymbol();
+    TokenLexeme lexeme = root->getToken().lexeme;
+    if (sym == SYM_NUM) {
+        out += mips::lis(dst);
+        out += mips::word(std::stoi(std::string(g_strings.str(lexeme))));
+    } else if (sym == SYM_NULL) {
+        out += mips::lis(dst);
+        out += mips::word(69);
+    } else if (sym == SYM_ID) {
+        Identifier id = lexeme;
+        Register reg = g_tables.getRegister(id);
+        if (reg != 0) {
+            out += mips::add(dst, reg, 0);
+        } else {
+            out += mips::lw(dst, g_tables.getOffset(id), g_tables.getFrame());
+        }
+    }
+}
+
+// Schedules the evaluation of a call's arguments into where the callee
+// expects them, and returns how many were pushed on the stack
+size_t arguments(Plan& out, TreeNode* arglist) {
+    std::vector<TreeNode*> args = arglist->getChildSymbolNodes(SYM_EXPR);
+
+    // A register argument followed by one that makes a call would be
+    // clobbered, so it is parked on the stack until all are evaluated
+    int nStack = stackArgumentCount(args.size());
+    int lastCall = -1;
+    for (int i = 0; i < (int)args.size(); ++i) {
+        if (args[i]->getHasCall()) lastCall = i;
+    }
+    for (int i = 0; i < (int)args.size(); ++i) {
+        out += code(args[i]);
+        if (i < nStack || i < lastCall) {
+            out += push(3);
+        } else {
+            out += mips::add(ARGUMENT_REGISTERS[i - nStack], 3, 0);
+        }
+    }
+    for (int i = lastCall - 1; i >= nStack; --i) {
+        out += pop(ARGUMENT_REGISTERS[i - nStack]);
+    }
+    return nStack;
+}
+
+// Assignments to a procedure's result variable after which it only returns,
+// mapped to the procedure's number of stack arguments. They are made as tail
+// calls, see tailJump.
+thread_local std::unordered_map<TreeNode*, size_t> g_tailCalls;
+
+// The call an expression consists of, if it can be made as a tail call
+TreeNode* tailCallOf(TreeNode* expr) {
+    TreeNode* call = unwrap(expr);
+    ProductionId production = call->getProductionId();
+    if (production != FACTOR_ID_LPAREN_RPAREN && production != FACTOR_ID_LPAREN_ARGLIST_RPAREN) return nullptr;
+    if (g_procedures.at(call->children[0]->getToken().lexeme).inlined) return nullptr;
+    return call;
+}
+
+// Adds the assignments result = call(...) that end the last statement of a
+// procedure, or of an arm of an if statement ending one, to g_tailCalls.
+// WLP4 only returns at the end, so this is where its tail calls are.
+void findTailCalls(TreeNode* statements, Identifier result, size_t nStackParams) {
+    std::vector<TreeNode*> work = {statements};
+    while (!work.empty()) {
+        TreeNode* node = work.back();
+        work.pop_back();
+        if (node->getProductionId() != STATEMENTS_STATEMENTS_STATEMENT) continue;
+
+        TreeNode* statement = node->children[1];
+        switch (statement->getProductionId()) {
+            case STATEMENT_IF_LPAREN_TEST_RPAREN_LBRACE_STATEMENTS_RBRACE_ELSE_LBRACE_STATEMENTS_RBRACE:
+                work.push_back(statement->children[5]);
+                work.push_back(statement->children[9]);
+                break;
+            case STATEMENT_LVALUE_BECOMES_EXPR_SEMI: {
+                TreeNode* lvalue = statement->children[0];
+                while (lvalue->getProductionId() == LVALUE_LPAREN_LVALUE_RPAREN) {
+                    lvalue = lvalue->children[1];
+                }
+                if (lvalue->getProductionId() == LVALUE_ID && lvalue->children[0]->getToken().lexeme == result &&
+                    tailCallOf(statement->children[2])) {
+                    g_tailCalls[statement] = nStackParams;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+}
+
+// Schedules a call in tail position from a procedure with nStackParams stack
+// arguments and a frame. The callee's stack arguments are moved up to where
+// the procedure's came in, the frame is popped, and the callee returns
+// straight to the procedure's caller.
+void tailJump(Plan& out, TreeNode* call, size_t nStackParams) {
+    Identifier id = call->children[0]->getToken().lexeme;
+    int32_t nStackArgs = 0;
+    if (call->getProductionId() == FACTOR_ID_LPAREN_ARGLIST_RPAREN) {
+        nStackArgs = arguments(out, call->children[2]);
+    }
+
+    // The saved registers are read before the arguments can overwrite them.
+    // The arguments only move up, so copying from the first (the highest)
+    // down never overwrites one that is still to be copied.
+    out += mips::lw(31, -4, 29);
+    out += mips::lw(5, 0, 29);
+    for (int32_t j = 0; j < nStackArgs; ++j) {
+        out += mips::lw(6, 4 * (nStackArgs - 1 - j), 30);
+        out += mips::sw(6, 4 * (int32_t)nStackParams - 4 * j, 29);
+    }
+    out += mips::lis(6);
+    out += mips::word(4 + 4 * (int32_t)nStackParams - 4 * nStackArgs);
+    out += mips::add(30, 29, 6);
+    out += mips::add(29, 5, 0);
+    out += mips::lis(5);
+    out += mips::word(std::string("F") + std::string(g_strings.str(id)));
+    out += mips::jr(5);
+}
+
+// The variables a while loop, or a loop nested in it, assigns to, and whether
+// it stores through a pointer
+struct LoopSummary {
+    std::unordered_set<Identifier> assigned;
+    bool storesThroughPointer = false;
+};
+
+// Summaries of the loops seen so far in the current procedure, and the
+// invariants hoisted out of the loops being generated, mapped to the
+// temporaries that hold them
+thread_local std::unordered_map<TreeNode*, LoopSummary> g_loops;
+thread_local std::unordered_map<TreeNode*, Register> g_hoisted;
+
+// Summarizes loop and every loop nested in it in a single walk, so that a
+// deep nest is not walked again for each level
+const LoopSummary& summarizeLoop(TreeNode* loop) {
+    auto it = g_loops.find(loop);
+    if (it != g_loops.end()) return it->second;
+
+    // Each loop is pushed a second time to fold it into the enclosing one
+    // once its body has been walked
+    std::vector<std::pair<TreeNode*, bool>> work = {{loop, false}};
+    std::vector<TreeNode*> open;
+    while (!work.empty()) {
+        TreeNode* node = work.back().first;
+        bool leaving = work.back().second;
+        work.pop_back();
+        if (leaving) {
+            open.pop_back();
+            if (!open.empty()) {
+                LoopSummary& outer = g_loops[open.back()];
+                const LoopSummary& inner = g_loops[node];
+                outer.assigned.insert(inner.assigned.begin(), inner.assigned.end());
+                outer.storesThroughPointer = outer.storesThroughPointer || inner.storesThroughPointer;
+            }
+            continue;
+        }
+        if (node->T()) continue;
+
+        ProductionId production = node->getProductionId();
+        if (production == STATEMENT_WHILE_LPAREN_TEST_RPAREN_LBRACE_STATEMENTS_RBRACE) {
+            open.push_back(node);
+            g_loops[node];
+            work.push_back({node, true});
+        } else if (production == STATEMENT_LVALUE_BECOMES_EXPR_SEMI) {
+            TreeNode* lvalue = node->children[0];
+            while (lvalue->getProductionId() == LVALUE_LPAREN_LVALUE_RPAREN) {
+                lvalue = lvalue->children[1];
+            }
+            LoopSummary& summary = g_loops[open.back()];
+            if (lvalue->getProductionId() == LVALUE_ID) {
+                summary.assigned.insert(lvalue->children[0]->getToken().lexeme);
+            } else {
+                summary.storesThroughPointer = true;
+            }
+        }
+        for (size_t i = node->children.size(); i > 0; --i) {
+            work.push_back({node->children[i - 1], false});
+        }
+    }
+    return g_loops[loop];
+}
+
+// The largest expressions in a call-free loop that keep their value while it
+// runs and take more than one instruction to compute. They are built from
+// constants, variables the loop does not assign, addresses of variables, +,
+// - and *, and / and % by constants other than 0 and -1. Loads are never
+// invariant, and nothing that can fault is, since the loop body may not run
+// at all. When the loop stores through a pointer, only variables in
+// registers are safe from it. Expressions in nested loops are left to them.
+std::vector<TreeNode*> loopInvariants(TreeNode* loop) {
+    const LoopSummary& summary = summarizeLoop(loop);
+    TreeNode* test = loop->children[2];
+    TreeNode* statements = loop->children[5];
+
+    std::vector<TreeNode*> nodes;
+    std::vector<TreeNode*> work = {statements, test};
+    while (!work.empty()) {
+        TreeNode* node = work.back();
+        work.pop_back();
+        nodes.push_back(node);
+        if (node->T() || node->getProductionId() == STATEMENT_WHILE_LPAREN_TEST_RPAREN_LBRACE_STATEMENTS_RBRACE) {
+            continue;
+        }
+        for (size_t i = node->children.size(); i > 0; --i) {
+            work.push_back(node->children[i - 1]);
+        }
+    }
+
+    // Children come after their parents in nodes, so walking it backwards
+    // decides them first
+    std::unordered_set<TreeNode*> invariant;
+    for (auto it = nodes.rbegin(); it != nodes.rend(); ++it) {
+        TreeNode* node = *it;
+        if (node->T()) {
+            invariant.insert(node);
+            continue;
+        }
+        auto is = [&](size_t i) {
+            return invariant.count(node->children[i]) > 0;
+        };
+        bool result = false;
+        switch (node->getProductionId()) {
+            case FACTOR_ID: {
+                Identifier id = node->children[0]->getToken().lexeme;
+                result = summary.assigned.count(id) == 0 &&
+                    (!summary.storesThroughPointer || g_tables.getRegister(id) != 0);
+                break;
+            }
+            case FACTOR_NUM:
+            case FACTOR_NULL:
+            case LVALUE_ID:
+                result = true;
+                break;
+            case EXPR_TERM:
+            case TERM_FACTOR:
+                result = is(0);
+                break;
+            case FACTOR_LPAREN_EXPR_RPAREN:
+            case FACTOR_AMP_LVALUE:
+            case LVALUE_STAR_FACTOR:
+            case LVALUE_LPAREN_LVALUE_RPAREN:
+                result = is(1);
+                break;
+            case EXPR_EXPR_PLUS_TERM:
+            case EXPR_EXPR_MINUS_TERM:
+            case TERM_TERM_STAR_FACTOR:
+                result = is(0) && is(2);
+                break;
+            case TERM_TERM_SLASH_FACTOR:
+            case TERM_TERM_PCT_FACTOR: {
+                TreeNode* divisor = node->children[2];
+                result = is(0) && divisor->isConstant() && divisor->getValue() != 0 && divisor->getValue() != -1;
+                break;
+            }
+            default:
+                break;
+        }
+        if (result) invariant.insert(node);
+    }
+
+    // A constant is a single lis and a variable a single lw or move already
+    auto worthwhile = [](TreeNode* node) {
+        Symbol symbol = node->getSymbol();
+        if (symbol != SYM_EXPR && symbol != SYM_TERM && symbol != SYM_FACTOR) return false;
+        if (node->isConstant()) return false;
+        ProductionId production = unwrap(node)->getProductionId();
+        return production != FACTOR_ID && production != FACTOR_NUM && production != FACTOR_NULL;
+    };
+
+    std::vector<TreeNode*> invariants;
+    work = {statements, test};
+    while (!work.empty()) {
+        TreeNode* node = work.back();
+        work.pop_back();
+        if (node->T() || node->getProductionId() == STATEMENT_WHILE_LPAREN_TEST_RPAREN_LBRACE_STATEMENTS_RBRACE) {
+            continue;
+        }
+        if (invariant.count(node) && worthwhile(node)) {
+            invariants.push_back(unwrap(node));
+            continue;
+        }
+        for (size_t i = node->children.size(); i > 0; --i) {
+            work.push_back(node->children[i - 1]);
+        }
+    }
+    return invariants;
+}
+
+// Schedules a procedure's body, from setting up its frame to returning with
+// the value in $3. An inlined body is entered and left by falling through
+// instead, and leaves its caller's $31 alone.
+void procedureBody(Plan& out, TreeNode* procedure, bool inlined) {
+    TreeNode* params = procedure->children[3];
+    TreeNode* dcls = procedure->children[6];
+    TreeNode* statements = procedure->children[7];
+    TreeNode* returnExpr = procedure->children[9];
+
+    std::vector<TreeNode*> paramIds;
+    if (params->getProductionId() == PARAMS_PARAMLIST) {
+        TreeNode* paramlist = params->children[0];
+        while (true) {
+            paramIds.push_back(paramlist->children[0]->children[1]);
+            if (paramlist->getProductionId() != PARAMLIST_DCL_COMMA_PARAMLIST) break;
+            paramlist = paramlist->children[2];
+        }
+    }
+    size_t nStackParams = stackArgumentCount(paramIds.size());
+    bool leaf = !procedure->getHasCall();
+
+    // Register arguments stay where they are in a leaf procedure unless
+    // their address is taken; otherwise they move into the frame
+    std::vector<bool> inRegister(paramIds.size(), false);
+    if (leaf && nStackParams < paramIds.size()) {
+        std::unordered_set<Identifier> addressTaken = addressTakenVariables(procedure);
+        for (size_t i = nStackParams; i < paramIds.size(); ++i) {
+            inRegister[i] = addressTaken.count(paramIds[i]->getToken().lexeme) == 0;
+        }
+    }
+
+    // Tail calls need a frame to tear down
+    TreeNode* tailCall = leaf ? nullptr : tailCallOf(returnExpr);
+    TreeNode* result = unwrap(returnExpr);
+    if (!leaf && result->getProductionId() == FACTOR_ID) {
+        findTailCalls(statements, result->children[0]->getToken().lexeme, nStackParams);
+    }
+    bool hasVariables = tailCall || dcls->getProductionId() != DCLS_EMPTY ||
+        std::find(inRegister.begin(), inRegister.end(), false) != inRegister.end();
+
+    // The caller keeps nothing but its frame ($29) in registers across
+    // a call, so that and the return address are all a procedure has
+    // to save, and only when it overwrites them. A leaf procedure
+    // never calls out and addresses its variables from $7 instead,
+    // leaving $29 alone.
+    Register frame = leaf ? 7 : 29;
+    if (hasVariables && !leaf) {
+        // 0($29) is the caller's $29 and -4($29) the return address
+        out += mips::sw(29, -4, 30);
+        out += mips::sub(29, 30, 4);
+        out += mips::sw(31, -4, 29);
+        out += mips::sub(30, 29, 4);
+    } else if (hasVariables) {
+        out += mips::sub(7, 30, 4);
+    } else if (!leaf) {
+        out += push(31);
+    }
+
+    // The symbol table is only set up once this point is reached, since
+    // the arguments of an inlined call come before it
+    out += run([=]() {
+        g_tables.push();
+        g_tables.setFrame(frame, leaf ? 0 : 2);
+        for (size_t i = 0; i < paramIds.size(); ++i) {
+            Identifier id = paramIds[i]->getToken().lexeme;
+            Type type = paramIds[i]->getType();
+            if (i < nStackParams) {
+                g_tables.insertParameterVariable(id, type);
+            } else if (inRegister[i]) {
+                g_tables.insertRegisterVariable(id, type, ARGUMENT_REGISTERS[i - nStackParams]);
+            } else {
+                g_tables.insertLocalVariable(id, type);
+            }
+        }
+        g_tables.invertParamOffsets();
+    });
+    for (size_t i = nStackParams; i < paramIds.size(); ++i) {
+        if (!inRegister[i]) out += push(ARGUMENT_REGISTERS[i - nStackParams]);
+    }
+    out += code(dcls);
+    out += code(statements);
+
+    if (tailCall) {
+        tailJump(out, tailCall, nStackParams);
+        out += run([]() { g_tables.pop(); });
+        return;
+    }
+    out += code(returnExpr);
+
+    // Pop the locals and the stack arguments along with the frame
+    if (hasVariables) {
+        if (!leaf) out += mips::lw(31, -4, 29);
+        if (nStackParams == 0) {
+            out += mips::add(30, frame, 4);
+        } else {
+            out += mips::lis(5);
+            out += mips::word(4 + 4 * nStackParams);
+            out += mips::add(30, frame, 5);
+        }
+        if (!leaf) out += mips::lw(29, 0, 29);
+    } else if (!leaf) {
+        out += pop(31);
+    }
+    if (!inlined) out += mips::jr(31);
+    out += run([]() { g_tables.pop(); });
+}
+
+void codeN(TreeNode* root, int depth, Plan& out) {
+    NodeTimer timer(root->getProductionId(), g_options.nodeStats);
+    //std::cerr << root->getProduction() << std::endl;
+    Register dst = TEMPS[depth];
+    if (root->isConstant()) {
+        out += mips::lis(dst);
+        out += mips::word(root->getValue());
+        return;
+    }
+    if (!g_hoisted.empty()) {
+        auto hoisted = g_hoisted.find(root);
+        if (hoisted != g_hoisted.end()) {
+            out += mips::add(dst, hoisted->second, 0);
+            return;
+        }
+    }
+    int32_t offset = 0;
+    TreeNode* base = splitOffset(root, offset);
+    if (base != root) {
+        out += code(base, depth);
+        if (offset != 0) {
+            out += mips::lis(5);
+            out += mips::word(offset);
+            out += mips::add(dst, dst, 5);
+        }
+        return;
+    }
+    if (TreeNode* operand = identityOperand(root)) {
+        out += code(operand, depth);
+        return;
+    }
+
+    switch (root->getProductionId()) {
+        case MAIN_INT_WAIN_LPAREN_DCL_COMMA_DCL_RPAREN_LBRACE_DCLS_STATEMENTS_RETURN_EXPR_SEMI_RBRACE: {
+            g_tables.push();
+
+            TreeNode* paramDcl1 = root->children[3];
+            TreeNode* paramDcl2 = root->children[5];
+            TreeNode* varDcls = root->children[8];
+            TreeNode* statements = root->children[9];
+            TreeNode* returnExpr = root->children[11];
+
+            // wain always calls init, so its return address goes in the
+            // first frame slot
+            out += mips::label("Fwain");
+            out += mips::sub(29, 30, 4);
+            out += push(31);
+            g_tables.setFrame(29, 1);
+
+            // Initialize alloc library
+            if (paramDcl1->children[1]->getType() == INT_STAR) {
+                // array input
+                out += push(29);
+                out += mips::lis(5);
+                out += mips::word("init");
+                out += mips::jalr(5);
+                out += pop(29);
+            } else if (paramDcl1->children[1]->getType() == INT) {
+                // twoints input
+                out += push(29);
+                out += push(2);
+                out += mips::lis(2);
+                out += mips::word(0);
+                out += mips::lis(5);
+                out += mips::word("init");
+                out += mips::jalr(5);
+                out += pop(2);
+                out += pop(29);
+            }
+            out += push(1);
+            out += code(paramDcl1);
+            out += push(2);
+            out += code(paramDcl2);
+            out += code(varDcls);
+            out += code(statements);
+            out += code(returnExpr);
+            out += mips::lw(31, 0, 29);
+            out += mips::jr(31);
+            return;
+        }
+        case TYPE_INT: {
+            return;
+        }
+        case DCL_TYPE_ID: {
+            TreeNode* idNode = root->children[1];
+            Identifier id = idNode->getToken().lexeme;
+            Type type = idNode->getType();
+        
+            g_tables.insertLocalVariable(id, type);
+            return;
+        }
+        case DCLS_EMPTY: {
+            return;
+        }
+        case STATEMENTS_EMPTY: {
+            return;
+        }
+        case EXPR_TERM: {
+            TreeNode* term = root->children[0];
+            out += code(term, depth);
+            return;
+        }
+        case TERM_FACTOR: {
+            TreeNode* factor = root->children[0];
+            out += code(factor, depth);
+            return;
+        }
+        case FACTOR_NUM: {
+            TreeNode* num = root->children[0];
+            out += code(num, depth);
+            return;
+        }
+        case FACTOR_ID: {
+            TreeNode* id = root->children[0];
+            out += code(id, depth);
+            return;
+        }
+        case FACTOR_LPAREN_EXPR_RPAREN: {
+            TreeNode* expr = root->children[1];
+            out += code(expr, depth);
+            return;
+        }
+        case DCLS_DCLS_DCL_BECOMES_NUM_SEMI: {
+            TreeNode* dcls = root->children[0];
+            TreeNode* dcl = root->children[1];
+            TreeNode* num = root->children[3];
+
+            out += code(dcls);
+            out += code(dcl);
+            out += code(num);
+            out += push(3);
+            return;
+        }
+        case STATEMENTS_STATEMENTS_STATEMENT: {
+            TreeNode* statements = root->children[0];
+            TreeNode* statement = root->children[1];
+
+            out += code(statements);
+            out += code(statement);
+            return;
+        }
+        case STATEMENT_LVALUE_BECOMES_EXPR_SEMI: {
+            TreeNode* lvalue = root->children[0];
+            TreeNode* expr = root->children[2];
+
+            auto tail = g_tailCalls.find(root);
+            if (tail != g_tailCalls.end()) {
+                tailJump(out, unwrap(expr), tail->second);
+                return;
+            }
+
+            // Nothing the expression does can move a variable, so its address
+            // is computed last, right before the sw it can be folded into
+            TreeNode* variable = lvalue;
+            while (variable->getProductionId() == LVALUE_LPAREN_LVALUE_RPAREN) {
+                variable = variable->children[1];
+            }
+            if (variable->getProductionId() == LVALUE_ID) {
+                Register reg = g_tables.getRegister(variable->children[0]->getToken().lexeme);
+                out += code(expr);
+                if (reg != 0) {
+                    out += mips::add(reg, 3, 0);
+                    return;
+                }
+                out += code(lvalue, 1);
+                out += mips::sw(3, 0, TEMPS[1]);
+                return;
+            }
+
+            auto regs = operands(out, lvalue, expr, 0);
+            out += mips::sw(regs.second, 0, regs.first);
+            return;
+        }
+        case LVALUE_ID: {
+            // LVALUES RETURN EXACT ADDRESS;
+            Identifier id = root->children[0]->getToken().lexeme;
+            if (g_tables.getRegister(id) != 0) {
+                std::cerr << "ERROR: Cannot take the address of register variable " << g_strings.str(id) << std::endl;
+                throw std::exception();
+            }
+
+            out += mips::lis(5);
+            out += mips::word(g_tables.getOffset(id));
+            out += mips::add(dst, g_tables.getFrame(), 5);
+            return;
+        }
+        case LVALUE_LPAREN_LVALUE_RPAREN: {
+            TreeNode* lvalue = root->children[1];
+            out += code(lvalue, depth);
+            return;
+        }
+        case EXPR_EXPR_PLUS_TERM: {
+            TreeNode* expr = root->children[0];
+            TreeNode* term = root->children[2];
+
+            Type t1 = expr->getType();
+            Type t2 = term->getType();
+            auto regs = operands(out, expr, term, depth);
+            Register a = regs.first;
+            Register b = regs.second;
+            if (t1 == INT && t2 == INT) {
+                out += mips::add(dst, a, b);
+            } else if (t1 == INT_STAR && t2 == INT) {
+                multiplyConstant(out, b, 4);
+                out += mips::add(dst, a, b);
+            } else if (t1 == INT && t2 == INT_STAR) {
+                multiplyConstant(out, a, 4, 6);
+                out += mips::add(dst, a, b);
+            }
+            return;
+        }
+        case EXPR_EXPR_MINUS_TERM: {
+            TreeNode* expr = root->children[0];
+            TreeNode* term = root->children[2];
+
+            Type t1 = expr->getType();
+            Type t2 = term->getType();
+            auto regs = operands(out, expr, term, depth);
+            Register a = regs.first;
+            Register b = regs.second;
+            if (t1 == INT && t2 == INT) {
+                out += mips::sub(dst, a, b);
+            } else if (t1 == INT_STAR && t2 == INT) {
+                multiplyConstant(out, b, 4);
+                out += mips::sub(dst, a, b);
+            } else if (t1 == INT_STAR && t2 == INT_STAR) {
+                out += mips::sub(dst, a, b);
+                dividePowerOfTwo(out, dst, 2);
+            }
+            return;
+        }
+        case TERM_TERM_STAR_FACTOR: {
+            TreeNode* term = root->children[0];
+            TreeNode* factor = root->children[2];
+
+            // Only the other operand of a constant needs a register
+            if (term->isConstant() || factor->isConstant()) {
+                out += code(factor->isConstant() ? term : factor, depth);
+                multiplyConstant(out, dst, (factor->isConstant() ? factor : term)->getValue());
+                return;
+            }
+
+            auto regs = operands(out, term, factor, depth);
+            out += mips::mult(regs.first, regs.second);
+            out += mips::mflo(dst);
+            return;
+        }
+        case TERM_TERM_SLASH_FACTOR: {
+            TreeNode* term = root->children[0];
+            TreeNode* factor = root->children[2];
+
+            if (int k = powerOfTwo(factor)) {
+                out += code(term, depth);
+                dividePowerOfTwo(out, dst, k);
+                if (factor->getValue() < 0) out += mips::sub(dst, 0, dst);
+                return;
+            }
+            if (factor->isConstant() && factor->getValue() == -1) {
+                out += code(term, depth);
+                out += mips::sub(dst, 0, dst);
+                return;
+            }
+
+            auto regs = operands(out, term, factor, depth);
+            out += mips::div(regs.first, regs.second);
+            out += mips::mflo(dst);
+            return;
+        }
+        case TERM_TERM_PCT_FACTOR: {
+            TreeNode* term = root->children[0];
+            TreeNode* factor = root->children[2];
+
+            // x % 2^k is x - x / 2^k * 2^k, with x kept in the next temporary.
+            // The remainder takes the sign of x, so that of 2^k does not matter.
+            int k = powerOfTwo(factor);
+            if (k > 0 && depth + 1 < g_tempLimit) {
+                Register copy = TEMPS[depth + 1];
+                out += code(term, depth);
+                out += mips::add(copy, dst, 0);
+                dividePowerOfTwo(out, dst, k);
+                multiplyConstant(out, dst, 1 << k);
+                out += mips::sub(dst, copy, dst);
+                return;
+            }
+            if (factor->isConstant() && factor->getValue() == -1) {
+                out += code(term, depth);
+                out += mips::add(dst, 0, 0);
+                return;
+            }
+
+            auto regs = operands(out, term, factor, depth);
+            out += mips::div(regs.first, regs.second);
+            out += mips::mfhi(dst);
+            return;
+        }
+        case STATEMENT_IF_LPAREN_TEST_RPAREN_LBRACE_STATEMENTS_RBRACE_ELSE_LBRACE_STATEMENTS_RBRACE: {
+            TreeNode* test = root->children[2];
+            TreeNode* ifStatements = root->children[5];
+            TreeNode* elseStatements = root->children[9];
+            std::string else_label = newLabel("else");
+            std::string endif_label = newLabel("endif");
+
+            // Only one arm of a constant test can ever run
+            if (test->isConstant()) {
+                out += code(test->getValue() ? ifStatements : elseStatements);
+                return;
+            }
+
+            // An empty arm needs no jump around it
+            if (elseStatements->getProductionId() == STATEMENTS_EMPTY) {
+                branch(out, test, false, endif_label);
+                out += code(ifStatements);
+                out += mips::label(endif_label);
+                return;
+            }
+            if (ifStatements->getProductionId() == STATEMENTS_EMPTY) {
+                branch(out, test, true, endif_label);
+                out += code(elseStatements);
+                out += mips::label(endif_label);
+                return;
+            }
+
+            branch(out, test, false, else_label);
+            out += code(ifStatements);
+            out += mips::beq(0, 0, endif_label);
+            out += mips::label(else_label);
+            out += code(elseStatements);
+            out += mips::label(endif_label);
+            return;
+        }
+        case STATEMENT_WHILE_LPAREN_TEST_RPAREN_LBRACE_STATEMENTS_RBRACE: {
+            TreeNode* test = root->children[2];
+            TreeNode* statements = root->children[5];
+            std::string loop_label = newLabel("loop");
+            std::string test_label = newLabel("test");
+
+            if (test->isConstant() && !test->getValue()) return;
+
+            // Invariants are computed once, ahead of the loop, into
+            // temporaries taken off the top that the loop then leaves alone
+            std::vector<TreeNode*> invariants;
+            int limit = g_tempLimit;
+            int room = limit - std::max<int>(root->getRegisterNeed(), 2);
+            if (g_options.licm && !root->getHasCall() && room > 0) invariants = loopInvariants(root);
+            if (invariants.size() > static_cast<size_t>(std::max(room, 0))) invariants.resize(room);
+            if (!invariants.empty()) {
+                g_tempLimit = limit - invariants.size();
+                for (size_t i = 0; i < invariants.size(); ++i) {
+                    out += code(invariants[i]);
+                    out += mips::add(TEMPS[g_tempLimit + i], 3, 0);
+                }
+                out += run([=]() {
+                    for (size_t i = 0; i < invariants.size(); ++i) {
+                        g_hoisted[invariants[i]] = TEMPS[limit - invariants.size() + i];
+                    }
+                });
+            }
+
+            if (test->isConstant()) {
+                out += mips::label(loop_label);
+                out += code(statements);
+                out += mips::beq(0, 0, loop_label);
+            } else {
+                // The test sits at the bottom, so each iteration takes one branch
+                out += mips::beq(0, 0, test_label);
+                out += mips::label(loop_label);
+                out += code(statements);
+                out += mips::label(test_label);
+                branch(out, test, true, loop_label);
+            }
+
+            if (!invariants.empty()) {
+                out += run([=]() {
+                    for (TreeNode* invariant : invariants) {
+                        g_hoisted.erase(invariant);
+                    }
+                    g_tempLimit = limit;
+                });
+            }
+            return;
+        }
+        case STATEMENT_PRINTLN_LPAREN_EXPR_RPAREN_SEMI: {
+            TreeNode* expr = root->children[2];
+
+            out += code(expr);
+            out += push(3);
+            out += pop(1);
+            out += push(29);
+            out += mips::jalr(10);
+            out += pop(29);
+            return;
+        }
+        case PROCEDURE_INT_ID_LPAREN_PARAMS_RPAREN_LBRACE_DCLS_STATEMENTS_RETURN_EXPR_SEMI_RBRACE: {
+            Identifier id = root->children[1]->getToken().lexeme;
+            if (g_procedures.at(id).inlined) return;  // every call is replaced by the body
+
+            out += mips::label(std::string("F") + std::string(g_strings.str(id)));
+            procedureBody(out, root, false);
+            return;
+        }
+        case FACTOR_ID_LPAREN_RPAREN: {
+            Identifier id = root->children[0]->getToken().lexeme;
+            const ProcedureInfo& callee = g_procedures.at(id);
+
+            out += saveTemps(depth);
+            if (callee.inlined) {
+                procedureBody(out, callee.node, true);
+            } else {
+                out += mips::lis(5);
+                out += mips::word(std::string("F") + std::string(g_strings.str(id)));
+                out += mips::jalr(5);
+            }
+            if (depth > 0) out += mips::add(dst, 3, 0);
+            out += restoreTemps(depth);
+            return;
+        }
+        case FACTOR_ID_LPAREN_ARGLIST_RPAREN: {
+            TreeNode* arglist = root->children[2];
+
+            Identifier id = root->children[0]->getToken().lexeme;
+            const ProcedureInfo& callee = g_procedures.at(id);
+
+            out += saveTemps(depth);
+            arguments(out, arglist);
+
+            // The callee pops the arguments
+            if (callee.inlined) {
+                procedureBody(out, callee.node, true);
+            } else {
+                out += mips::lis(5);
+                out += mips::word(std::string("F") + std::string(g_strings.str(id)));
+                out += mips::jalr(5);
+            }
+            if (depth > 0) out += mips::add(dst, 3, 0);
+            out += restoreTemps(depth);
+            return;
+        }
+        case ARGLIST_EXPR: {
+            return;
+        }
+        case ARGLIST_EXPR_COMMA_ARGLIST: {
+            return;
+        }
+        case TYPE_INT_STAR: {
+            return;
+        }
+        case DCLS_DCLS_DCL_BECOMES_NULL_SEMI: {
+            TreeNode* dcls = root->children[0];
+            TreeNode* dcl = root->children[1];
+            TreeNode* null = root->children[3];
+
+            out += code(dcls);
+            out += code(dcl);
+            out += code(null);
+            out += push(3);
+            return;
+        }
+        case FACTOR_NULL: {
+            TreeNode* null = root->children[0];
+            out += code(null, depth);
+            return;
+        }
+        case FACTOR_AMP_LVALUE: {
+            TreeNode* lvalue = root->children[1];
+            out += code(lvalue, depth);
+            return;
+        }
+        case FACTOR_STAR_FACTOR: {
+            TreeNode* factor = root->children[1];
+
+            out += code(factor, depth);
+            out += mips::lw(dst, 0, dst);
+            return;
+        }
+        case LVALUE_STAR_FACTOR: {
+            TreeNode* factor = root->children[1];
+
+            out += code(factor, depth);
+            return;
         }
+        case FACTOR_NEW_INT_LBRACK_EXPR_RBRACK: {
+            TreeNode* expr = root->children[3];
 
-        Type getType(Identifier id) {
-            return this->current().getType(id);
+            out += code(expr, depth);
+            out += push(dst);
+            out += pop(1);
+            out += saveTemps(depth);
+            out += push(29);
+            out += mips::lis(5);
+            out += mips::word("new");
+            out += mips::jalr(5);
+            out += pop(29);
+            out += mips::bne(3, 0, 2);
+            out += mips::lis(3);
+            out += mips::word(69);
+            if (depth > 0) out += mips::add(dst, 3, 0);
+            out += restoreTemps(depth);
+            return;
         }
+        case STATEMENT_DELETE_LBRACK_RBRACK_EXPR_SEMI: {
+            TreeNode* expr = root->children[3];
+            std::string skipDelete_label = newLabel("skipDelete");
 
-        std::string getOffset(Identifier id) {
-            return this->current().getOffset(id);
+            out += code(expr);
+            out += mips::lis(5);
+            out += mips::word(69);
+            out += mips::beq(3, 5, skipDelete_label);
+            out += push(3);
+            out += pop(1);
+            out += push(29);
+            out += mips::lis(5);
+            out += mips::word("delete");
+            out += mips::jalr(5);
+            out += pop(29);
+            out += mips::label(skipDelete_label);
+            return;
         }
+        default:
+            break;
+    }
+}
 
-        void invertParamOffsets() {
-            this->current().invertParamOffsets();
+// Drives codeN/codeT from an explicit work stack rather than recursing once
+// per tree level, so arbitrarily long statement chains cannot overflow the
+// call stack. Each node's plan is pushed in reverse, so steps run in order.
+void generate(TreeNode* root, Peephole& out) {
+    std::vector<Step> work;
+    work.push_back(code(root));
+
+    Plan plan;
+    while (!work.empty()) {
+        Step step = std::move(work.back());
+        work.pop_back();
+        switch (step.kind) {
+            case Step::EMIT:
+                for (const Instr& instr : step.instrs) {
+                    out << instr;
+                }
+                break;
+            case Step::RUN:
+                step.fn();
+                break;
+            case Step::CODE:
+                plan.steps.clear();
+                if (step.node->N()) {
+                    codeN(step.node, step.depth, plan);
+                } else {
+                    codeT(step.node, step.depth, plan);
+                }
+                for (auto it = plan.steps.rbegin(); it != plan.steps.rend(); ++it) {
+                    work.push_back(std::move(*it));
+                }
+                break;
+        }
+    }
+}
+
+// Hash of the compiler's own executable, which stands in for its version:
+// any rebuild that changes the generated code changes the binary too
+uint64_t g_compilerHash = 0;
+
+// Sets up --cache=DIR: hashes the running executable and creates DIR if it
+// is missing. Without either, cached code could be stale or never written.
+bool openCache() {
+    std::ifstream exe("/proc/self/exe", std::ios::binary);
+    std::ostringstream contents;
+    contents << exe.rdbuf();
+    if (!exe || contents.str().empty()) {
+        std::cerr << "ERROR: could not read the compiler executable to key the cache" << std::endl;
+        return false;
+    }
+    g_compilerHash = Hasher().add(contents.str()).first;
+
+    if (mkdir(g_options.cacheDir.c_str(), 0777) != 0 && errno != EEXIST) {
+        std::cerr << "ERROR: could not create cache directory " << g_options.cacheDir << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// The cache key of a procedure's code: the compiler's hash, its tree, the
+// options that affect code generation, and whatever it uses from the
+// procedures it calls.
+Hasher cacheKey(TreeNode* procedure) {
+    Hasher key;
+    key.add(g_compilerHash);
+    key.add(g_options.peephole).add(g_options.registerArgs).add(g_options.licm).add(g_options.inlineBudget);
+    key.add(g_options.merl);
+    key.addTree(procedure);
+    if (procedure->getProductionId() == PROCEDURE_INT_ID_LPAREN_PARAMS_RPAREN_LBRACE_DCLS_STATEMENTS_RETURN_EXPR_SEMI_RBRACE) {
+        key.add(g_procedures.at(procedure->children[1]->getToken().lexeme).inlined);
+    }
+
+    std::vector<TreeNode*> work = {procedure};
+    while (!work.empty()) {
+        TreeNode* node = work.back();
+        work.pop_back();
+        if (node->T()) continue;
+        ProductionId production = node->getProductionId();
+        if (production == FACTOR_ID_LPAREN_RPAREN || production == FACTOR_ID_LPAREN_ARGLIST_RPAREN) {
+            const ProcedureInfo& callee = g_procedures.at(node->children[0]->getToken().lexeme);
+            key.add(callee.inlined).add(callee.inlined ? callee.hash : 0);
+        }
+        for (TreeNode* child : node->children) {
+            work.push_back(child);
+        }
+    }
+    return key;
+}
+
+std::string hex(uint64_t value) {
+    std::ostringstream s;
+    s << std::hex << value;
+    return s.str();
+}
+
+// Reads a procedure's code from the cache into text. An entry starts with a
+// line holding the key's second hash, to catch collisions on the first.
+bool readCache(const Hasher& key, Emitter& text) {
+    std::ifstream file(g_options.cacheDir + "/" + hex(key.first) + ".asm", std::ios::binary);
+    std::string check;
+    if (!file || !std::getline(file, check) || check != hex(key.second)) return false;
+
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    text << contents.str();
+    return true;
+}
+
+// Best effort: a cache that cannot be written to only costs the time saved.
+// Entries are written under a temporary name and renamed into place, so
+// concurrent compilers never see half an entry.
+void writeCache(const Hasher& key, Emitter& text, size_t job) {
+    std::string path = g_options.cacheDir + "/" + hex(key.first) + ".asm";
+    std::string temp = path + "." + std::to_string(getpid()) + "." + std::to_string(job);
+    {
+        std::ofstream file(temp, std::ios::binary);
+        if (!file) return;
+        file << hex(key.second) << "\n";
+        text.writeTo(file);
+        if (!file) {
+            std::remove(temp.c_str());
+            return;
+        }
+    }
+    if (std::rename(temp.c_str(), path.c_str()) != 0) std::remove(temp.c_str());
+}
+
+// Code generated for one procedure (or wain) on a worker thread
+struct Job {
+    explicit Job(TreeNode* procedure): procedure(procedure) {}
+
+    TreeNode* procedure;
+    std::unique_ptr<Emitter> text;
+    std::exception_ptr error;
+    bool done = false;
+};
+
+// Generates the procedures on g_options.jobs threads and appends their code
+// to out, each as soon as it and the ones before it are done. wain comes
+// first, so the program falls into it with no branch that could be out of
+// range, then the other procedures in program order. Procedures share
+// nothing but the tree, g_procedures and g_strings.
+void generateProgram(TreeNode* root, Emitter& out) {
+    Timer timer(t_stats.phases[GENERATE]);
+    std::deque<Job> jobs;
+    TreeNode* procedures = root->children[1];
+    while (procedures->getProductionId() == PROCEDURES_PROCEDURE_PROCEDURES) {
+        jobs.emplace_back(procedures->children[0]);
+        procedures = procedures->children[1];
+    }
+    jobs.emplace_front(procedures->children[0]);
+
+    std::mutex lock;
+    std::condition_variable finished;
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t i = next++; i < jobs.size(); i = next++) {
+            Job& job = jobs[i];
+            g_tables = SymbolTableStack();
+            g_tailCalls.clear();
+            g_loops.clear();
+            g_hoisted.clear();
+            g_tempLimit = NTEMPS;
+            g_procedureName = std::string(g_strings.str(job.procedure->children[1]->getToken().lexeme));
+            labelCtr = 0;
+            t_labels.clear();
+
+            job.text = std::make_unique<Emitter>();
+            Timer timer(t_stats.phases[PROCEDURES]);
+            try {
+                bool cached = !g_options.cacheDir.empty();
+                Hasher key = cached ? cacheKey(job.procedure) : Hasher();
+                if (!cached || !readCache(key, *job.text)) {
+                    {
+                        Peephole peephole(*job.text, g_options.peephole);
+                        generate(job.procedure, peephole);
+                    }
+                    if (cached) writeCache(key, *job.text, i);
+                }
+            } catch (...) {
+                job.error = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> guard(lock);
+            job.done = true;
+            finished.notify_all();
+        }
+        mergeStats();
+    };
+
+    std::vector<std::thread> workers;
+    if (g_options.jobs > 1) {
+        for (size_t i = 0; i < std::min(g_options.jobs, jobs.size()); ++i) {
+            workers.emplace_back(work);
+        }
+    } else {
+        work();
+    }
+
+    std::exception_ptr error;
+    for (Job& job : jobs) {
+        std::unique_lock<std::mutex> guard(lock);
+        finished.wait(guard, [&]() { return job.done; });
+        guard.unlock();
+
+        if (job.error && !error) error = job.error;
+        if (!error) out.append(*job.text);
+        job.text.reset();
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    if (error) std::rethrow_exception(error);
+}
+
+// The runtime's procedures, which the program imports
+const std::vector<std::string_view> RUNTIME_PROCEDURES = {"print", "init", "new", "delete"};
+
+void putWord(std::string& out, uint32_t word) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        out.push_back(static_cast<char>(word >> shift));
+    }
+}
+
+// Assembles instruction records into a MERL object file: a header, the code
+// from address 12 on, and a footer with a REL entry for each .word holding a
+// code address and an ESR entry for each use of a runtime procedure. Labels
+// get their addresses in a first pass and are resolved in a second. The
+// address of each procedure's entry label goes in entries, if given.
+void writeMerl(Emitter& records, std::ostream& output, std::vector<std::pair<std::string, uint32_t>>* entries = nullptr) {
+    Timer timer(t_stats.phases[OUTPUT]);
+    std::ostringstream buffer;
+    records.writeTo(buffer);
+    std::string data = buffer.str();
+    std::vector<std::pair<Instr, std::string_view>> instrs;
+    ByteReader reader(data);
+    while (!reader.done()) {
+        std::string_view label;
+        Instr instr = Instr::read(reader, label);
+        instrs.push_back({instr, label});
+    }
+
+    const uint32_t HEADER_SIZE = 12;
+    std::unordered_map<std::string_view, uint32_t> labels;
+    uint32_t address = HEADER_SIZE;
+    for (const auto& [instr, label] : instrs) {
+        if (instr.op != LABEL) {
+            address += 4;
+        } else if (!labels.insert({label, address}).second) {
+            std::cerr << "ERROR: duplicate label " << label << std::endl;
+            throw std::exception();
+        }
+    }
+    uint32_t endCode = address;
+    if (entries) {
+        std::vector<std::string> names = {"wain"};
+        for (const auto& procedure : g_procedures) {
+            names.emplace_back(g_strings.str(procedure.first));
+        }
+        for (const std::string& name : names) {
+            auto it = labels.find("F" + name);
+            if (it != labels.end()) entries->push_back({name, it->second});
+        }
+    }
+
+    auto undefined = [](std::string_view label) {
+        std::cerr << "ERROR: undefined label " << label << std::endl;
+        throw std::exception();
+    };
+    auto immediate = [](int32_t value) {
+        if (value < INT16_MIN || value > INT16_MAX) {
+            std::cerr << "ERROR: immediate out of range " << value << std::endl;
+            throw std::exception();
+        }
+        return static_cast<uint32_t>(value) & 0xffff;
+    };
+    // The function field of each register instruction, or the opcode of
+    // each instruction with an immediate, indexed by Opcode
+    const uint32_t ENCODINGS[] = {0x20, 0x22, 0x18, 0x1a, 0x10, 0x12, 0x14, 0x23, 0x2b, 0x2a, 0x2b, 0x04, 0x05, 0x08, 0x09};
+
+    std::string code;
+    std::string footer;
+    code.reserve(endCode - HEADER_SIZE);
+    address = HEADER_SIZE;
+    for (const auto& [instr, label] : instrs) {
+        if (instr.op == LABEL) continue;
+        uint32_t s = instr.s;
+        uint32_t t = instr.t;
+        uint32_t d = instr.d;
+        uint32_t word = 0;
+        switch (instr.op) {
+            case ADD: case SUB: case SLT: case SLTU:
+                word = s << 21 | t << 16 | d << 11 | ENCODINGS[instr.op];
+                break;
+            case MULT: case DIV:
+                word = s << 21 | t << 16 | ENCODINGS[instr.op];
+                break;
+            case MFHI: case MFLO: case LIS:
+                word = d << 11 | ENCODINGS[instr.op];
+                break;
+            case JR: case JALR:
+                word = s << 21 | ENCODINGS[instr.op];
+                break;
+            case LW: case SW:
+                word = ENCODINGS[instr.op] << 26 | s << 21 | t << 16 | immediate(instr.imm);
+                break;
+            case BEQ: case BNE: {
+                int32_t offset = instr.imm;
+                if (!label.empty()) {
+                    auto it = labels.find(label);
+                    if (it == labels.end()) undefined(label);
+                    offset = (static_cast<int32_t>(it->second) - static_cast<int32_t>(address) - 4) / 4;
+                }
+                word = ENCODINGS[instr.op] << 26 | s << 21 | t << 16 | immediate(offset);
+                break;
+            }
+            case WORD: {
+                word = instr.imm;
+                if (label.empty()) break;
+                auto it = labels.find(label);
+                if (it != labels.end()) {
+                    word = it->second;
+                    putWord(footer, 0x01);
+                    putWord(footer, address);
+                    break;
+                }
+                if (std::find(RUNTIME_PROCEDURES.begin(), RUNTIME_PROCEDURES.end(), label) == RUNTIME_PROCEDURES.end()) {
+                    undefined(label);
+                }
+                putWord(footer, 0x11);
+                putWord(footer, address);
+                putWord(footer, label.size());
+                for (char c : label) {
+                    putWord(footer, static_cast<unsigned char>(c));
+                }
+                break;
+            }
+            default:
+                break;
+        }
+        putWord(code, word);
+        address += 4;
+    }
+
+    std::string header;
+    putWord(header, 0x10000002);
+    putWord(header, endCode + footer.size());
+    putWord(header, endCode);
+    output << header << code << footer;
+}
+
+// Runs a MERL object in-process for --run, standing in for the runtime's
+// procedures, and profiles it. Memory is 16MB, with the object loaded at 0,
+// the stack at the top, and an array input and then the heap after the code.
+// Cycles count one per instruction except for mult and div, which take as
+// long as on an R3000; the runtime stand-ins are free.
+class Machine {
+    public:
+        static const uint32_t MEMORY_SIZE = 1 << 24;
+        static const uint32_t EXIT = 0x8123456c;
+        static const uint32_t RUNTIME = 0xffff0000;  // + 4 * index in RUNTIME_PROCEDURES
+
+        Machine(std::string_view merl, std::vector<std::pair<std::string, uint32_t>> entries)
+        : memory(MEMORY_SIZE / 4, 0) {
+            auto word = [&](uint32_t address) {
+                if (address % 4 || address + 4 > merl.size()) malformed();
+                uint32_t value = 0;
+                for (uint32_t i = 0; i < 4; ++i) {
+                    value = value << 8 | static_cast<unsigned char>(merl[address + i]);
+                }
+                return value;
+            };
+            if (merl.size() < 12 || word(0) != 0x10000002) malformed();
+            uint32_t endModule = word(4);
+            this->endCode = word(8);
+            if (endModule > merl.size() || this->endCode > endModule || this->endCode >= MEMORY_SIZE / 2) malformed();
+            for (uint32_t address = 0; address < this->endCode; address += 4) {
+                this->memory[address / 4] = word(address);
+            }
+
+            // REL entries need nothing, since the object is loaded at 0
+            for (uint32_t address = this->endCode; address < endModule;) {
+                uint32_t type = word(address);
+                if (type == 0x01) {
+                    address += 8;
+                    continue;
+                }
+                if (type != 0x05 && type != 0x11) malformed();
+                uint32_t location = word(address + 4);
+                uint32_t length = word(address + 8);
+                std::string name;
+                for (uint32_t i = 0; i < length; ++i) {
+                    name.push_back(static_cast<char>(word(address + 12 + 4 * i)));
+                }
+                address += 12 + 4 * length;
+                if (type == 0x05) continue;
+                auto it = std::find(RUNTIME_PROCEDURES.begin(), RUNTIME_PROCEDURES.end(), name);
+                if (it == RUNTIME_PROCEDURES.end() || location % 4 || location >= this->endCode) malformed();
+                this->memory[location / 4] = RUNTIME + 4 * (it - RUNTIME_PROCEDURES.begin());
+            }
+
+            for (uint32_t i = 0; i < this->endCode / 4; ++i) {
+                this->code.push_back(decode(this->memory[i]));
+            }
+
+            // Code ahead of the first procedure is the program's setup
+            std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) { return a.second < b.second; });
+            this->procedures.push_back({"(start)", 0});
+            for (const auto& entry : entries) {
+                this->procedures.push_back({entry.first, entry.second});
+            }
+            size_t procedure = 0;
+            for (uint32_t i = 0; i < this->code.size(); ++i) {
+                while (procedure + 1 < this->procedures.size() && this->procedures[procedure + 1].entry <= 4 * i) ++procedure;
+                this->owner.push_back(procedure);
+            }
+
+            this->heapTop = this->endCode;
+            this->regs[30] = MEMORY_SIZE;
+            this->regs[31] = EXIT;
+        }
+
+        // wain(int, int) gets values[0] and values[1]; wain(int*, int) gets
+        // the values as an array placed after the code
+        void setInput(bool array, const std::vector<int32_t>& values) {
+            if (!array) {
+                this->regs[1] = values.size() > 0 ? values[0] : 0;
+                this->regs[2] = values.size() > 1 ? values[1] : 0;
+                return;
+            }
+            if (values.size() > MEMORY_SIZE / 8) fault("array input too large");
+            this->regs[1] = this->heapTop;
+            this->regs[2] = values.size();
+            for (int32_t value : values) {
+                this->memory[this->heapTop / 4] = value;
+                this->heapTop += 4;
+            }
+        }
+
+        void run(std::ostream& output) {
+            uint32_t* regs = this->regs;
+            while (this->pc != EXIT) {
+                this->current = this->pc;
+                if (this->pc - RUNTIME < 4 * RUNTIME_PROCEDURES.size()) {
+                    this->callRuntime((this->pc - RUNTIME) / 4, output);
+                    this->pc = regs[31];
+                    continue;
+                }
+                uint32_t index = this->pc / 4;
+                if (this->pc % 4 || index >= this->code.size()) fault("jump to a bad address");
+
+                const Instr& instr = this->code[index];
+                Profile& profile = this->procedures[this->owner[index]];
+                ++profile.instructions;
+                if (this->pc == profile.entry) ++profile.calls;
+                ++this->instructions;
+                ++this->cycles;
+                this->pc += 4;
+
+                uint32_t s = regs[instr.s];
+                uint32_t t = regs[instr.t];
+                switch (instr.op) {
+                    case ADD: regs[instr.d] = s + t; break;
+                    case SUB: regs[instr.d] = s - t; break;
+                    case SLT: regs[instr.d] = static_cast<int32_t>(s) < static_cast<int32_t>(t); break;
+                    case SLTU: regs[instr.d] = s < t; break;
+                    case MULT: {
+                        int64_t product = static_cast<int64_t>(static_cast<int32_t>(s)) * static_cast<int32_t>(t);
+                        this->lo = static_cast<uint32_t>(product);
+                        this->hi = static_cast<uint32_t>(static_cast<uint64_t>(product) >> 32);
+                        this->cycles += MULT_CYCLES - 1;
+                        break;
+                    }
+                    case DIV: {
+                        int64_t a = static_cast<int32_t>(s);
+                        int64_t b = static_cast<int32_t>(t);
+                        if (b == 0) fault("division by zero");
+                        this->lo = static_cast<uint32_t>(a / b);
+                        this->hi = static_cast<uint32_t>(a % b);
+                        this->cycles += DIV_CYCLES - 1;
+                        break;
+                    }
+                    case MFHI: regs[instr.d] = this->hi; break;
+                    case MFLO: regs[instr.d] = this->lo; break;
+                    case LIS:
+                        regs[instr.d] = this->load(this->pc, false);
+                        this->pc += 4;
+                        break;
+                    case LW: regs[instr.t] = this->load(s + instr.imm, true); break;
+                    case SW: this->store(s + instr.imm, t); break;
+                    case BEQ: if (s == t) this->pc += 4 * instr.imm; break;
+                    case BNE: if (s != t) this->pc += 4 * instr.imm; break;
+                    case JR: this->pc = s; break;
+                    case JALR:
+                        regs[31] = this->pc;
+                        this->pc = s;
+                        break;
+                    default:
+                        fault("executed a word that is not an instruction");
+                }
+                regs[0] = 0;
+            }
+        }
+
+        void report(std::ostream& output) {
+            output << "wain returned " << static_cast<int32_t>(this->regs[3]) << "\n";
+            output << "instructions " << this->instructions << "\n";
+            output << "cycles " << this->cycles << "\n";
+            output << "loads " << this->loads << "\n";
+            output << "stores " << this->stores << "\n";
+
+            std::vector<Profile> profiles = this->procedures;
+            std::stable_sort(profiles.begin(), profiles.end(), [](const Profile& a, const Profile& b) {
+                return a.instructions > b.instructions;
+            });
+            size_t width = 9;
+            for (const Profile& profile : profiles) {
+                width = std::max(width, profile.name.size());
+            }
+            output << std::left << std::setw(width) << "procedure" << std::right << std::setw(14) << "instructions"
+                   << std::setw(12) << "calls" << "\n";
+            for (const Profile& profile : profiles) {
+                if (profile.instructions == 0) continue;
+                output << std::left << std::setw(width) << profile.name << std::right << std::setw(14)
+                       << profile.instructions << std::setw(12) << profile.calls << "\n";
+            }
         }
+
     private:
-        std::deque<SymbolTable> s;
-} g_tables;
+        struct Profile {
+            std::string name;
+            uint32_t entry;
+            uint64_t instructions = 0;
+            uint64_t calls = 0;
+        };
 
-std::string pop(Register reg) {
-    std::string code = "";
-    code += "add $30, $30, $4\n";
-    code += std::string("lw ") + reg + ", -4($30)\n";
-    return code;
+        static const uint64_t MULT_CYCLES = 12;
+        static const uint64_t DIV_CYCLES = 35;
+
+        [[noreturn]] static void malformed() {
+            std::cerr << "ERROR: malformed MERL object" << std::endl;
+            throw std::exception();
+        }
+
+        [[noreturn]] void fault(const std::string& message) {
+            std::cerr << "ERROR: " << message << " at 0x" << std::hex << this->current << std::dec << std::endl;
+            throw std::exception();
+        }
+
+        // Words that are not one of the instructions we generate decode as
+        // WORD, and fault if they are executed
+        static Instr decode(uint32_t word) {
+            uint8_t s = word >> 21 & 31;
+            uint8_t t = word >> 16 & 31;
+            uint8_t d = word >> 11 & 31;
+            int32_t imm = static_cast<int16_t>(word & 0xffff);
+            switch (word >> 26) {
+                case 0x23: return mips::lw(t, imm, s);
+                case 0x2b: return mips::sw(t, imm, s);
+                case 0x04: return mips::beq(s, t, imm);
+                case 0x05: return mips::bne(s, t, imm);
+                case 0x00: break;
+                default: return mips::word(word);
+            }
+            if (word >> 6 & 0x1f) return mips::word(word);
+            switch (word & 0x3f) {
+                case 0x20: return mips::add(d, s, t);
+                case 0x22: return mips::sub(d, s, t);
+                case 0x2a: return mips::slt(d, s, t);
+                case 0x2b: return mips::sltu(d, s, t);
+                case 0x18: return mips::mult(s, t);
+                case 0x1a: return mips::div(s, t);
+                case 0x10: return mips::mfhi(d);
+                case 0x12: return mips::mflo(d);
+                case 0x14: return mips::lis(d);
+                case 0x08: return mips::jr(s);
+                case 0x09: return mips::jalr(s);
+                default: return mips::word(word);
+            }
+        }
+
+        uint32_t load(uint32_t address, bool counted) {
+            if (address % 4 || address >= MEMORY_SIZE) fault("bad load address " + std::to_string(address));
+            if (counted) ++this->loads;
+            return this->memory[address / 4];
+        }
+
+        void store(uint32_t address, uint32_t value) {
+            if (address % 4 || address >= MEMORY_SIZE) fault("bad store address " + std::to_string(address));
+            if (address < this->endCode) fault("store into code");
+            ++this->stores;
+            this->memory[address / 4] = value;
+        }
+
+        // The runtime preserves every register but $3. new reuses blocks of
+        // the same size that were deleted.
+        void callRuntime(size_t procedure, std::ostream& output) {
+            uint32_t* regs = this->regs;
+            std::string_view name = RUNTIME_PROCEDURES[procedure];
+            if (name == "print") {
+                output << static_cast<int32_t>(regs[1]) << "\n";
+            } else if (name == "new") {
+                int32_t words = regs[1];
+                regs[3] = 0;
+                if (words < 1 || words > static_cast<int32_t>(MEMORY_SIZE / 4)) return;
+                std::vector<uint32_t>& reusable = this->freeBlocks[words];
+                uint32_t block;
+                if (!reusable.empty()) {
+                    block = reusable.back();
+                    reusable.pop_back();
+                } else {
+                    // Leave the stack some room
+                    if (this->heapTop + 4 * words > regs[30] - (1 << 16)) return;
+                    block = this->heapTop;
+                    this->heapTop += 4 * words;
+                }
+                std::fill_n(this->memory.begin() + block / 4, words, 0);
+                this->blockSizes[block] = words;
+                regs[3] = block;
+            } else if (name == "delete") {
+                auto it = this->blockSizes.find(regs[1]);
+                if (it == this->blockSizes.end()) fault("delete of memory new did not return");
+                this->freeBlocks[it->second].push_back(it->first);
+                this->blockSizes.erase(it);
+            }
+        }
+
+        std::vector<uint32_t> memory;
+        std::vector<Instr> code;
+        std::vector<uint32_t> owner;
+        std::vector<Profile> procedures;
+        uint32_t endCode = 0;
+        uint32_t heapTop = 0;
+        std::unordered_map<uint32_t, std::vector<uint32_t>> freeBlocks;
+        std::unordered_map<uint32_t, uint32_t> blockSizes;
+        uint32_t regs[32] = {};
+        uint32_t hi = 0;
+        uint32_t lo = 0;
+        uint32_t pc = 0;
+        uint32_t current = 0;  // address of the instruction being run
+        uint64_t instructions = 0;
+        uint64_t cycles = 0;
+        uint64_t loads = 0;
+        uint64_t stores = 0;
+};
+
+// Compiles one program, given as source or as a parse tree. Everything a
+// compile sets up is torn down again, so batch and server modes can run any
+// number of them in one process. With --merl, entries gets the procedures'
+// addresses (see writeMerl).
+// What one compile leaves behind: the tree, the procedure table and the
+// strings interned for it. The worker threads have joined by the time
+// compile() returns or throws, so nothing refers to them any more.
+void clearUnit() {
+    g_arena.clear();
+    g_procedures.clear();
+    g_strings.trim();
 }
 
-std::string push(Register reg) {
-    std::string code = "";
-    code += std::string("sw ") + reg + ", -4($30)\n";
-    code += "sub $30, $30, $4\n";
-    return code;
+void compileUnit(std::string_view program, std::ostream& output, std::vector<std::pair<std::string, uint32_t>>* entries) {
+    TreeNode* root = loadTree(program);
+    g_strings.freeze();
+    if (!g_options.stats.empty()) {
+        t_stats.nodes += g_arena.size();
+        for (NodeId id = 0; id < g_arena.size(); ++id) {
+            TreeNode* node = g_arena.at(id);
+            if (node->T() && node->getSymbol() != SYM_EMPTY) ++t_stats.terminals;
+        }
+    }
+    annotateTree();
+    planInlining();
+    Emitter out(g_options.merl ? nullptr : &output);
+    if (!g_options.merl) {
+        for (std::string_view name : RUNTIME_PROCEDURES) {
+            out << ".import " << name << "\n";
+        }
+    }
+    out << mips::lis(4) << mips::word(4);
+    out << mips::lis(10) << mips::word("print");
+    out << mips::lis(11) << mips::word(1);
+    generateProgram(root, out);
+    if (g_options.merl) writeMerl(out, output, entries);
+    out.flush();
 }
 
-unsigned long long labelCtr = 0;
+void compile(std::string_view program, std::ostream& output, std::vector<std::pair<std::string, uint32_t>>* entries = nullptr) {
+    clearUnit();
+    try {
+        compileUnit(program, output, entries);
+    } catch (...) {
+        clearUnit();
+        throw;
+    }
+    clearUnit();
+}
 
-std::string code(TreeNode* root);
+// Prints what --stats collected, as a table or as JSON. Times are wall
+// clock milliseconds.
+void reportStats(std::ostream& output) {
+    mergeStats();
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
 
-std::string codeT(TreeNode* root) {
-    Symbol sym = root->getSymbol();
-    TokenLexeme lexeme = root->getToken().lexeme;
-    if (sym == "NUM") {
-        std::string num = lexeme;
-        return std::string("lis $3\n") +
-               std::string(".word ") + num + "\n";
-    } else if (sym == "NULL") {
-        return std::string("lis $3\n") +
-               std::string(".word 69\n");
-    } else if (sym == "ID") {
-        Identifier id = lexeme;
-        return std::string("lw $3, ") + g_tables.getOffset(id) + "($29)\n";
+    auto ms = [](const Counter& counter) {
+        std::ostringstream s;
+        s << std::fixed << std::setprecision(3) << counter.nanoseconds / 1e6;
+        return s.str();
+    };
+    std::vector<ProductionId> productions;
+    for (int i = 0; i < NUM_PRODUCTIONS; ++i) {
+        if (g_stats.codeN[i].calls > 0) productions.push_back(static_cast<ProductionId>(i));
+    }
+    std::stable_sort(productions.begin(), productions.end(), [](ProductionId a, ProductionId b) {
+        return g_stats.codeN[a].nanoseconds > g_stats.codeN[b].nanoseconds;
+    });
+
+    if (g_options.stats == "json") {
+        auto counter = [&](const Counter& counter) {
+            output << "{\"calls\": " << counter.calls << ", \"ms\": " << ms(counter) << ", \"allocations\": "
+                   << counter.allocations << ", \"bytes\": " << counter.bytes << "}";
+        };
+        output << "{\n  \"phases\": {";
+        for (int i = 0; i < NUM_PHASES; ++i) {
+            output << (i > 0 ? "," : "") << "\n    \"" << PHASE_NAMES[i] << "\": ";
+            counter(g_stats.phases[i]);
+        }
+        output << "\n  },\n  \"codeN\": {";
+        for (size_t i = 0; i < productions.size(); ++i) {
+            output << (i > 0 ? "," : "") << "\n    \"" << WLP4_PRODUCTIONS[productions[i]] << "\": ";
+            counter(g_stats.codeN[productions[i]]);
+        }
+        output << "\n  },\n  \"symbol tables\": {";
+        for (int i = 0; i < NUM_TABLE_METHODS; ++i) {
+            output << (i > 0 ? "," : "") << "\n    \"" << TABLE_METHOD_NAMES[i] << "\": " << g_stats.tableCalls[i];
+        }
+        output << "\n  },\n  \"nodes\": " << g_stats.nodes << ",\n  \"terminals\": " << g_stats.terminals
+               << ",\n  \"peak_rss_kb\": " << usage.ru_maxrss << "\n}" << std::endl;
+        return;
+    }
+
+    size_t width = 13;
+    for (ProductionId production : productions) {
+        width = std::max(width, WLP4_PRODUCTIONS[production].size());
+    }
+    auto row = [&](std::string_view name, const Counter& counter) {
+        output << std::left << std::setw(width) << name << std::right << std::setw(10) << counter.calls
+               << std::setw(12) << ms(counter) << std::setw(14) << counter.allocations << std::setw(14)
+               << counter.bytes << "\n";
+    };
+    auto header = [&](std::string_view title) {
+        output << std::left << std::setw(width) << title << std::right << std::setw(10) << "calls" << std::setw(12)
+               << "ms" << std::setw(14) << "allocations" << std::setw(14) << "bytes" << "\n";
+    };
+    header("phase");
+    for (int i = 0; i < NUM_PHASES; ++i) {
+        row(PHASE_NAMES[i], g_stats.phases[i]);
+    }
+    output << "\n";
+    header("codeN");
+    for (ProductionId production : productions) {
+        row(WLP4_PRODUCTIONS[production], g_stats.codeN[production]);
     }
-    return "";
+    output << "\n" << std::left << std::setw(width) << "symbol tables" << std::right << std::setw(10) << "calls" << "\n";
+    for (int i = 0; i < NUM_TABLE_METHODS; ++i) {
+        output << std::left << std::setw(width) << TABLE_METHOD_NAMES[i] << std::right << std::setw(10)
+               << g_stats.tableCalls[i] << "\n";
+    }
+    output << "\nnodes " << g_stats.nodes << " (" << g_stats.terminals << " terminals)\n";
+    output << "peak RSS " << usage.ru_maxrss << " kB" << std::endl;
 }
 
-std::string codeN(TreeNode* root) {
-    Production production = root->getProduction();
-    //std::cerr << production << std::endl;
-    if (production == "start BOF procedures EOF") {
-        TreeNode* procedures = root->children[1];
-        return code(procedures);
-    } else if (production == "procedures main") {
-        TreeNode* main = root->children[0];
-        return code(main);
-    } else if (production == "main INT WAIN LPAREN dcl COMMA dcl RPAREN LBRACE dcls statements RETURN expr SEMI RBRACE") {
-        g_tables.push();
+// Compiles program and runs it in the simulator on the given input. The
+// program's output goes to stdout and the profile to stderr.
+int runProgram(std::string_view program, bool array, const std::vector<int32_t>& values) {
+    g_options.merl = true;
+    std::ostringstream object;
+    std::vector<std::pair<std::string, uint32_t>> entries;
+    compile(program, object, &entries);
 
-        TreeNode* paramDcl1 = root->children[3];
-        TreeNode* paramDcl2 = root->children[5];
-        TreeNode* varDcls = root->children[8];
-        TreeNode* statements = root->children[9];
-        TreeNode* returnExpr = root->children[11];
-
-        // Initialize alloc library
-        std::string out;
-        out += std::string("Fwain:\n");
-        out += std::string("sub $29, $30, $4\n");
-        if (paramDcl1->children[1]->getType() == INT_STAR) {
-            // array input
-            out += push("$29");
-            out += push("$31");
-            out += std::string("lis $5\n");
-            out += std::string(".word init\n");
-            out += std::string("jalr $5\n");
-            out += pop("$31");
-            out += pop("$29");
-        } else if (paramDcl1->children[1]->getType() == INT) {
-            // twoints input
-            out += push("$29");
-            out += push("$31");
-            out += push("$2");
-            out += std::string("lis $2\n");
-            out += std::string(".word 0\n");
-            out += std::string("lis $5\n");
-            out += std::string(".word init\n");
-            out += std::string("jalr $5\n");
-            out += pop("$2");
-            out += pop("$31");
-            out += pop("$29");
-        }
-        out += push("$1");
-        out += code(paramDcl1);
-        out += push("$2");
-        out += code(paramDcl2);
-        out += code(varDcls);
-        out += code(statements);
-        out += code(returnExpr);
-        out += std::string("jr $31\n");
-        return out;
-    } else if (production == "type INT") {
-        return "";
-    } else if (production == "dcl type ID") {
-        TreeNode* idNode = root->children[1];
-        Identifier id = idNode->getToken().lexeme;
-        Type type = idNode->getType();
-        
-        g_tables.insertLocalVariable(id, type);
-        return "";
-    } else if (production == "dcls .EMPTY") {
-        return "";
-    } else if (production == "statements .EMPTY") {
-        return "";
-    } else if (production == "expr term") {
-        TreeNode* term = root->children[0];
-        return code(term);
-    } else if (production == "term factor") {
-        TreeNode* factor = root->children[0];
-        return code(factor);
-    } else if (production == "factor NUM") {
-        TreeNode* num = root->children[0];
-        return code(num);
-    } else if (production == "factor ID") {
-        TreeNode* id = root->children[0];
-        return code(id);
-    } else if (production == "factor LPAREN expr RPAREN") {
-        TreeNode* expr = root->children[1];
-        return code(expr);
-    } else if (production == "dcls dcls dcl BECOMES NUM SEMI") {
-        TreeNode* dcls = root->children[0];
-        TreeNode* dcl = root->children[1];
-        TreeNode* num = root->children[3];
-
-        std::string out = "";
-        out += code(dcls);
-        out += code(dcl);
-        out += code(num);
-        out += push("$3");
-        return out;
-    } else if (production == "statements statements statement") {
-        TreeNode* statements = root->children[0];
-        TreeNode* statement = root->children[1];
-
-        std::string out = "";
-        out += code(statements);
-        out += code(statement);
-        return out;
-    } else if (production == "statement lvalue BECOMES expr SEMI") {
-        TreeNode* lvalue = root->children[0];
-        TreeNode* expr = root->children[2];
-
-        std::string out = "";
-        out += code(lvalue);
-        out += push("$3");
-        out += code(expr);
-        out += pop("$5");
-        out += std::string("sw $3, 0($5)\n");
-        return out;
-    } else if (production == "lvalue ID") {
-        // LVALUES RETURN EXACT ADDRESS;
-        Identifier id = root->children[0]->getToken().lexeme;
-
-        std::string out = "";
-        out += std::string("lis $5\n");
-        out += std::string(".word ") + g_tables.getOffset(id) + "\n";
-        out += std::string("add $3, $29, $5\n");
-        return out;
-    } else if (production == "lvalue LPAREN lvalue RPAREN") {
-        TreeNode* lvalue = root->children[1];
-        return code(lvalue);
-    } else if (production == "expr expr PLUS term") {
-        TreeNode* expr = root->children[0];
-        TreeNode* term = root->children[2];
-
-        std::string out = "";
-
-        Type t1 = expr->getType();
-        Type t2 = term->getType();
-        if (t1 == INT && t2 == INT) {
-            out += code(expr);
-            out += push("$3");
-            out += code(term);
-            out += pop("$5");
-            out += std::string("add $3, $5, $3\n");
-        } else if (t1 == INT_STAR && t2 == INT) {
-            out += code(expr);
-            out += push("$3");
-            out += code(term);
-            out += std::string("mult $3, $4\n");
-            out += std::string("mflo $3\n");
-            out += pop("$5");
-            out += std::string("add $3, $5, $3\n");
-        } else if (t1 == INT && t2 == INT_STAR) {
-            out += code(expr);
-            out += std::string("mult $3, $4\n");
-            out += std::string("mflo $3\n");
-            out += push("$3");
-            out += code(term);
-            out += pop("$5");
-            out += std::string("add $3, $5, $3\n");
-        }
-        return out;
-    } else if (production == "expr expr MINUS term") {
-        TreeNode* expr = root->children[0];
-        TreeNode* term = root->children[2];
-
-        std::string out = "";
-
-        Type t1 = expr->getType();
-        Type t2 = term->getType();
-        if (t1 == INT && t2 == INT) {
-            out += code(expr);
-            out += push("$3");
-            out += code(term);
-            out += pop("$5");
-            out += std::string("sub $3, $5, $3\n");
-        } else if (t1 == INT_STAR && t2 == INT) {
-            out += code(expr);
-            out += push("$3");
-            out += code(term);
-            out += std::string("mult $3, $4\n");
-            out += std::string("mflo $3\n");
-            out += pop("$5");
-            out += std::string("sub $3, $5, $3\n");
-        } else if (t1 == INT_STAR && t2 == INT_STAR) {
-            out += code(expr);
-            out += push("$3");
-            out += code(term);
-            out += pop("$5");
-            out += std::string("sub $3, $5, $3\n");
-            out += std::string("div $3, $4\n");
-            out += std::string("mflo $3\n");
-        }
-        return out;
-    } else if (production == "term term STAR factor") {
-        TreeNode* term = root->children[0];
-        TreeNode* factor = root->children[2];
-
-        std::string out = "";
-        out += code(term);
-        out += push("$3");
-        out += code(factor);
-        out += pop("$5");
-        out += std::string("mult $5, $3\n");
-        out += std::string("mflo $3\n");
-        return out;
-    } else if (production == "term term SLASH factor") {
-        TreeNode* term = root->children[0];
-        TreeNode* factor = root->children[2];
-
-        std::string out = "";
-        out += code(term);
-        out += push("$3");
-        out += code(factor);
-        out += pop("$5");
-        out += std::string("div $5, $3\n");
-        out += std::string("mflo $3\n");
-        return out;
-    } else if (production == "term term PCT factor") {
-        TreeNode* term = root->children[0];
-        TreeNode* factor = root->children[2];
-
-        std::string out = "";
-        out += code(term);
-        out += push("$3");
-        out += code(factor);
-        out += pop("$5");
-        out += std::string("div $5, $3\n");
-        out += std::string("mfhi $3\n");
-        return out;
-    } else if (production == "statement IF LPAREN test RPAREN LBRACE statements RBRACE ELSE LBRACE statements RBRACE") {
-        TreeNode* test = root->children[2];
-        TreeNode* ifStatements = root->children[5];
-        TreeNode* elseStatements = root->children[9];
-        std::string else_label = std::string("Felse") + std::to_string(labelCtr++) ;
-        std::string endif_label = std::string("Fendif") + std::to_string(labelCtr++);
-
-        std::string out = "";
-        out += code(test);
-        out += std::string("beq $3, $0, ") + else_label + "\n";
-        out += code(ifStatements);
-        out += std::string("beq $0, $0, ") + endif_label + "\n";
-        out += else_label + ":\n";
-        out += code(elseStatements);
-        out += endif_label + ":\n";
-        return out;
-    } else if (production == "statement WHILE LPAREN test RPAREN LBRACE statements RBRACE") {
-        TreeNode* test = root->children[2];
-        TreeNode* statements = root->children[5];
-        std::string loop_label = std::string("Floop") + std::to_string(labelCtr++);
-        std::string endwhile_label = std::string("Fendwhile") + std::to_string(labelCtr++);
-
-        std::string out = "";
-        out += loop_label + ":\n";
-        out += code(test);
-        out += std::string("beq $3, $0, ") + endwhile_label + "\n";
-        out += code(statements);
-        out += std::string("beq $0, $0, ") + loop_label + "\n";
-        out += endwhile_label + ":\n";
-        return out;
-    } else if (production == "test expr EQ expr") {
-        TreeNode* e1 = root->children[0];
-        TreeNode* e2 = root->children[2];
-
-        Type type = e1->getType();
-        std::string comparisonOp = "slt";
-        if (type == INT_STAR) comparisonOp = "sltu";
-
-        std::string out = "";
-        out += code(e1);
-        out += push("$3");
-        out += code(e2);
-        out += pop("$5");
-        out += comparisonOp + std::string(" $6, $3, $5\n");
-        out += comparisonOp + std::string(" $7, $5, $3\n");
-        out += std::string("add $3, $6, $7\n");
-        out += std::string("sub $3, $11, $3\n");
-        return out;
-    } else if (production == "test expr NE expr") {
-        TreeNode* e1 = root->children[0];
-        TreeNode* e2 = root->children[2];
-
-        Type type = e1->getType();
-        std::string comparisonOp = "slt";
-        if (type == INT_STAR) comparisonOp = "sltu";
-
-        std::string out = "";
-        out += code(e1);
-        out += push("$3");
-        out += code(e2);
-        out += pop("$5");
-        out += comparisonOp + std::string(" $6, $3, $5\n");
-        out += comparisonOp + std::string(" $7, $5, $3\n");
-        out += std::string("add $3, $6, $7\n");
-        return out;
-    } else if (production == "test expr LT expr") {
-        TreeNode* e1 = root->children[0];
-        TreeNode* e2 = root->children[2];
-
-        Type type = e1->getType();
-        std::string comparisonOp = "slt";
-        if (type == INT_STAR) comparisonOp = "sltu";
-
-        std::string out = "";
-        out += code(e1);
-        out += push("$3");
-        out += code(e2);
-        out += pop("$5");
-        out += comparisonOp + std::string(" $3, $5, $3\n");
-        return out;
-    } else if (production == "test expr LE expr") {
-        TreeNode* e1 = root->children[0];
-        TreeNode* e2 = root->children[2];
-
-        Type type = e1->getType();
-        std::string comparisonOp = "slt";
-        if (type == INT_STAR) comparisonOp = "sltu";
-
-        std::string out = "";
-
-        // LT
-        out += code(e1);
-        out += push("$3");
-        out += code(e2);
-        out += pop("$5");
-        out += comparisonOp + std::string(" $3, $5, $3\n");
-
-        // Push LT output
-        out += push("$3");
-
-        // EQ
-        out += code(e1);
-        out += push("$3");
-        out += code(e2);
-        out += pop("$5");
-        out += comparisonOp + std::string(" $6, $3, $5\n");
-        out += comparisonOp + std::string(" $7, $5, $3\n");
-        out += std::string("add $3, $6, $7\n");
-        out += std::string("sub $3, $11, $3\n");
-
-        // LT or EQ
-        out += pop("$5");
-        out += std::string("add $3, $5, $3\n");
-
-        return out;
-    } else if (production == "test expr GE expr") {
-        TreeNode* e1 = root->children[0];
-        TreeNode* e2 = root->children[2];
-
-        Type type = e1->getType();
-        std::string comparisonOp = "slt";
-        if (type == INT_STAR) comparisonOp = "sltu";
-
-        std::string out = "";
-
-        // GT
-        out += code(e1);
-        out += push("$3");
-        out += code(e2);
-        out += pop("$5");
-        out += comparisonOp + std::string(" $3, $3, $5\n");
-
-        // Push GT output
-        out += push("$3");
-
-        // EQ
-        out += code(e1);
-        out += push("$3");
-        out += code(e2);
-        out += pop("$5");
-        out += comparisonOp + std::string(" $6, $3, $5\n");
-        out += comparisonOp + std::string(" $7, $5, $3\n");
-        out += std::string("add $3, $6, $7\n");
-        out += std::string("sub $3, $11, $3\n");
-
-        // LT or EQ
-        out += pop("$5");
-        out += std::string("add $3, $5, $3\n");
-        
-        return out;
-    } else if (production == "test expr GT expr") {
-        TreeNode* e1 = root->children[0];
-        TreeNode* e2 = root->children[2];
-
-        Type type = e1->getType();
-        std::string comparisonOp = "slt";
-        if (type == INT_STAR) comparisonOp = "sltu";
-
-        std::string out = "";
-        out += code(e1);
-        out += push("$3");
-        out += code(e2);
-        out += pop("$5");
-        out += comparisonOp + std::string(" $3, $3, $5\n");
-        return out;
-    } else if (production == "statement PRINTLN LPAREN expr RPAREN SEMI") {
-        TreeNode* expr = root->children[2];
-
-        std::string out = "";
-        out += code(expr);
-        out += push("$3");
-        out += pop("$1");
-        out += push("$31");
-        out += push("$29");
-        out += std::string("jalr $10\n");
-        out += pop("$29");
-        out += pop("$31");
-        return out;
-    } else if (production == "procedures procedure procedures") {
-        TreeNode* procedure = root->children[0];
-        TreeNode* procedures = root->children[1];
-
-        std::string out = "";
-        out += code(procedure);
-        out += code(procedures);
-        return out;
-    } else if (production == "procedure INT ID LPAREN params RPAREN LBRACE dcls statements RETURN expr SEMI RBRACE") {
-        g_tables.push();
+    Machine machine(object.str(), entries);
+    machine.setInput(array, values);
+    machine.run(std::cout);
+    std::cout.flush();
+    machine.report(std::cerr);
+    return 0;
+}
 
-        TreeNode* params = root->children[3];
-        TreeNode* dcls = root->children[6];
-        TreeNode* statements = root->children[7];
-        TreeNode* returnExpr = root->children[9];
-
-        std::string label = std::string("F") + root->children[1]->getToken().lexeme;
-
-        std::string out = "";
-        out += label + ":\n";
-        out += std::string("sub $29, $30, $4\n");
-        out += code(params);  // g_tables elements for arguments will be inserted here
-        out += code(dcls);
-        out += push("$1") + push("$2") + push("$5") + push("$6") + push("$7");  // Save registers after dcls to keep local vars and params contiguous
-        out += code(statements);
-        out += code(returnExpr);
-        out += pop("$1") + pop("$2") + pop("$5") + pop("$6") + pop("$7");
-        out += std::string("jr $31\n");
-
-        g_tables.pop();
-        return out;
-    } else if (production == "params .EMPTY") {
-        return "";
-    } else if (production == "params paramlist") {
-        TreeNode* paramlist = root->children[0];
-        std::string out = "";
-        out += code(paramlist);
-        g_tables.invertParamOffsets();
-        return out;
-    } else if (production == "paramlist dcl") {
-        TreeNode* dcl = root->children[0];
-
-        TreeNode* idNode = dcl->children[1];
-        Identifier id = idNode->getToken().lexeme;
-        Type type = idNode->getType();
-
-        g_tables.insertParameterVariable(id, type);
-        return "";
-    } else if (production == "paramlist dcl COMMA paramlist") {
-        TreeNode* dcl = root->children[0];
-        TreeNode* paramlist = root->children[2];
-
-        TreeNode* idNode = dcl->children[1];
-        Identifier id = idNode->getToken().lexeme;
-        Type type = idNode->getType();
-
-        g_tables.insertParameterVariable(id, type);
-        return code(paramlist);
-    } else if (production == "factor ID LPAREN RPAREN") {
-        Identifier id = root->children[0]->getToken().lexeme;
-        std::string label = std::string("F") + id;
-
-        std::string out = "";
-        out += push("$29");
-        out += push("$31");
-        out += std::string("lis $5\n");
-        out += std::string(".word ") + label + "\n";
-        out += std::string("jalr $5\n");
-        out += pop("$31");
-        out += pop("$29");
-        return out;
-    } else if (production == "factor ID LPAREN arglist RPAREN") {
-        TreeNode* arglist = root->children[2];
-
-        std::vector<TreeNode*> args = arglist->getChildSymbolNodes("expr");
-        Identifier id = root->children[0]->getToken().lexeme;
-        std::string label = std::string("F") + id;
-
-        std::string out = "";
-        out += push("$29");
-        out += push("$31");
-
-        for (TreeNode* expr : args) {
-            out += code(expr);
-            out += push("$3");
-        }
-
-        out += std::string("lis $5\n");
-        out += std::string(".word ") + label + "\n";
-        out += std::string("jalr $5\n");
-
-        for (size_t i = 0; i < args.size(); ++i) {
-            out += pop("$5");
-        }
-
-        out += pop("$31");
-        out += pop("$29");
-        return out;
-    } else if (production == "arglist expr") {
-        return "";
-    } else if (production == "arglist expr COMMA arglist") {
-        return "";
-    } else if (production == "type INT STAR") {
-        return "";
-    } else if (production == "dcls dcls dcl BECOMES NULL SEMI") {
-        TreeNode* dcls = root->children[0];
-        TreeNode* dcl = root->children[1];
-        TreeNode* null = root->children[3];
-
-        std::string out = "";
-        out += code(dcls);
-        out += code(dcl);
-        out += code(null);
-        out += push("$3");
-        return out;
-    } else if (production == "factor NULL") {
-        TreeNode* null = root->children[0];
-        return code(null);
-    } else if (production == "factor AMP lvalue") {
-        TreeNode* lvalue = root->children[1];
-        return code(lvalue);
-    } else if (production == "factor STAR factor") {
-        TreeNode* factor = root->children[1];
-        
-        std::string out = "";
-        out += code(factor);
-        out += std::string("lw $3, 0($3)\n");
-        return out;
-    } else if (production == "lvalue STAR factor") {
-        TreeNode* factor = root->children[1];
-        
-        std::string out = "";
-        out += code(factor);
-        return out;
-    } else if (production == "factor NEW INT LBRACK expr RBRACK") {
-        TreeNode* expr = root->children[3];
-
-        std::string out = "";
-        out += code(expr);
-        out += push("$3");
-        out += pop("$1");
-        out += push("$31");
-        out += push("$29");
-        out += std::string("lis $5\n");
-        out += std::string(".word new\n");
-        out += std::string("jalr $5\n");
-        out += pop("$29");
-        out += pop("$31");
-        out += std::string("bne $3, $0, 2\n");
-        out += std::string("lis $3\n");
-        out += std::string(".word 69\n");
-        return out;
-    } else if (production == "statement DELETE LBRACK RBRACK expr SEMI") {
-        TreeNode* expr = root->children[3];
-        std::string skipDelete_label = std::string("FskipDelete") + std::to_string(labelCtr++);
-
-        std::string out = "";
-        out += code(expr);
-        out += std::string("lis $5\n");
-        out += std::string(".word 69\n");
-        out += std::string("beq $3, $5, ") + skipDelete_label + "\n";
-        out += push("$3");
-        out += pop("$1");
-        out += push("$31");
-        out += push("$29");
-        out += std::string("lis $5\n");
-        out += std::string(".word delete\n");
-        out += std::string("jalr $5\n");
-        out += pop("$29");
-        out += pop("$31");
-        out += skipDelete_label + ":\n";
-        return out;
-    }
-    return "";
-}
-
-std::string code(TreeNode* root) {
-    if (root->N()) {
-        return codeN(root);
+// Compiles every unit in a manifest, one "input output" pair of paths per
+// line. A unit that fails is reported and skipped, and its output removed.
+int runBatch(const std::string& manifest) {
+    std::ifstream units(manifest);
+    if (!units) {
+        std::cerr << "ERROR: could not open " << manifest << std::endl;
+        return 1;
+    }
+
+    int status = 0;
+    std::string line;
+    while (std::getline(units, line)) {
+        std::istringstream fields(line);
+        std::string input, output;
+        if (!(fields >> input)) continue;
+        if (!(fields >> output)) {
+            std::cerr << "ERROR: no output path for " << input << std::endl;
+            status = 1;
+            continue;
+        }
+
+        int fd = open(input.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "ERROR: could not open " << input << std::endl;
+            status = 1;
+            continue;
+        }
+        try {
+            InputBuffer tree(fd);
+            close(fd);
+            fd = -1;
+            std::ofstream file(output, std::ios::binary);
+            if (!file) {
+                std::cerr << "ERROR: could not write " << output << std::endl;
+                throw std::exception();
+            }
+            compile(tree.view(), file);
+        } catch (const std::exception& e) {
+            if (fd >= 0) close(fd);
+            std::remove(output.c_str());
+            std::cerr << "ERROR: could not compile " << input << std::endl;
+            status = 1;
+        }
+    }
+    return status;
+}
+
+bool writeAll(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t n = write(fd, data.data(), data.size());
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data.remove_prefix(n);
+    }
+    return true;
+}
+
+// How long the server waits on a client's reads or writes
+const time_t CLIENT_TIMEOUT_SECONDS = 10;
+
+// Serves compile jobs on a Unix socket until killed, one connection at a
+// time. A client writes a program or parse tree and shuts down its end for
+// writing; the reply is a line saying "ok" followed by the assembly, or just
+// "error" (the details go to the server's stderr).
+int runServer(const std::string& path) {
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "ERROR: socket path too long " << path << std::endl;
+        return 1;
+    }
+    std::strcpy(address.sun_path, path.c_str());
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str());
+    if (server < 0 || bind(server, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+        listen(server, 64) < 0) {
+        std::cerr << "ERROR: could not listen on " << path << std::endl;
+        return 1;
+    }
+
+    while (true) {
+        int client = accept(server, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            std::cerr << "ERROR: could not accept on " << path << std::endl;
+            return 1;
+        }
+
+        // A client that stalls fails its own request instead of holding up
+        // everyone queued behind it
+        timeval timeout = {CLIENT_TIMEOUT_SECONDS, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        std::ostringstream output;
+        bool ok = true;
+        try {
+            InputBuffer tree(client);
+            compile(tree.view(), output);
+        } catch (const std::exception& e) {
+            ok = false;
+        }
+        if (!g_options.stats.empty()) {
+            reportStats(std::cerr);
+            g_stats = Stats();
+        }
+        if (writeAll(client, ok ? "ok\n" : "error\n") && ok) writeAll(client, output.str());
+        close(client);
+    }
+}
+
+// Shapes of the synthetic programs for --synth and --bench. Each one stresses
+// a single kind of tree: a long statements chain, deeply nested if/while,
+// wide arglists, one huge expression, and thousands of procedures.
+const std::string_view SYNTHETIC_SHAPES[] = {"statements", "nesting", "arglist", "expression", "procedures"};
+
+// Writes the source of a program of the given shape with roughly nodes parse
+// tree nodes. The per-unit node counts were measured on the output.
+std::string syntheticSource(std::string_view shape, size_t nodes) {
+    std::string procedures;
+    std::string body;
+    if (shape == "statements") {
+        const char* const STATEMENTS[] = {
+            "x = x + a;\n", "println(x - b);\n", "if (x < b) { x = x * 2; } else { x = x / 3; }\n",
+            "while (x > a) { x = x - 1; }\n"
+        };
+        for (size_t i = 0; i < nodes / 30; ++i) {
+            body.append(STATEMENTS[i % 4]);
+        }
+    } else if (shape == "nesting") {
+        size_t depth = nodes / 43;
+        for (size_t i = 0; i < depth; ++i) {
+            body.append(i % 2 ? "if (x != a) {\n" : "while (x < b) {\n");
+            body.append("x = x + 1;\n");
+        }
+        for (size_t i = depth; i > 0; --i) {
+            body.append((i - 1) % 2 ? "} else { x = x - 1; }\n" : "}\n");
+        }
+    } else if (shape == "arglist") {
+        // The arglists get wider with the program, up to 1000 arguments
+        size_t width = std::min<size_t>(std::max<size_t>(nodes / 64, 2), 1000);
+        procedures.append("int f(");
+        for (size_t i = 0; i < width; ++i) {
+            procedures.append(i > 0 ? ", int p" : "int p").append(std::to_string(i));
+        }
+        procedures.append(") {\nreturn p0 + p").append(std::to_string(width - 1)).append(";\n}\n");
+        for (size_t i = 0; i < std::max<size_t>(nodes / (width * 8 + 12), 1); ++i) {
+            body.append("x = f(");
+            for (size_t j = 0; j < width; ++j) {
+                body.append(j == 0 ? "" : ", ").append(j % 3 == 0 ? "a" : j % 3 == 1 ? "x" : "b + 1");
+            }
+            body.append(");\n");
+        }
+    } else if (shape == "expression") {
+        const char* const TERMS[] = {" + a * b", " - (b - x)", " + x", " * 3"};
+        body.append("x = a");
+        for (size_t i = 0; i < nodes / 9; ++i) {
+            body.append(TERMS[i % 4]);
+        }
+        body.append(";\n");
+    } else if (shape == "procedures") {
+        size_t count = std::max<size_t>(nodes / 105, 1);
+        for (size_t i = 0; i < count; ++i) {
+            std::string name = "p" + std::to_string(i);
+            procedures.append("int ").append(name).append("(int u, int v) {\nint t = ");
+            procedures.append(std::to_string(i % 100)).append(";\nt = u * v + t;\n");
+            if (i > 0) {
+                procedures.append("if (t < v) { t = p").append(std::to_string(i - 1)).append("(v, u); } else {}\n");
+            }
+            procedures.append("return t - 1;\n}\n");
+        }
+        body.append("x = p").append(std::to_string(count - 1)).append("(a, b);\n");
     } else {
-        return codeT(root);
-    }
-}
-
-int main() {
-    TreeNode* root = loadParseTree(std::cin);
-    std::string asmCode;
-    asmCode += std::string(".import print\n");
-    asmCode += std::string(".import init\n");
-    asmCode += std::string(".import new\n");
-    asmCode += std::string(".import delete\n");
-    asmCode += std::string("lis $4\n");
-    asmCode += std::string(".word 4\n");
-    asmCode += std::string("lis $10\n");
-    asmCode += std::string(".word print\n");
-    asmCode += std::string("lis $11\n");
-    asmCode += std::string(".word 1\n");
-    asmCode += "beq $0, $0, Fwain\n";
-    asmCode += code(root);
-    std::cout << asmCode;
-    delete root;
+        std::cerr << "ERROR: unknown program shape " << shape << std::endl;
+        throw std::exception();
+    }
+    return procedures + "int wain(int a, int b) {\nint x = 0;\n" + body + "return x;\n}\n";
+}
+
+// Builds a synthetic program as a text parse tree, the format loadParseTree
+// reads, and reports its size in nodes
+std::string syntheticTree(std::string_view shape, size_t nodes, size_t& size) {
+    std::string source = syntheticSource(shape, nodes);
+    g_arena.clear();
+    std::ostringstream tree;
+    writeTextTree(loadSource(source), tree);
+    size = g_arena.size();
+    g_arena.clear();
+    return tree.str();
+}
+
+// Discards its output, keeping count of the bytes.
+class CountingBuffer : public std::streambuf {
+    public:
+        size_t count = 0;
+
+    protected:
+        std::streamsize xsputn(const char*, std::streamsize n) override {
+            this->count += n;
+            return n;
+        }
+
+        int overflow(int c) override {
+            if (c != traits_type::eof()) ++this->count;
+            return traits_type::not_eof(c);
+        }
+};
+
+// Compiles synthetic programs of every shape at sizes from 1000 nodes up to
+// maxNodes, growing tenfold, and prints the time taken to load the tree, to
+// generate code, and to emit it. Growth is ns/node over that of the previous
+// size; anything well above 1 is super-linear. Only the instruction formatting
+// is timed beyond the phases, so codegen runs as it would without --bench.
+int runBench(size_t maxNodes) {
+    g_options.timeOutput = true;
+    std::cout << std::left << std::setw(12) << "shape" << std::right << std::setw(10) << "nodes" << std::setw(11)
+              << "load ms" << std::setw(11) << "codegen ms" << std::setw(11) << "emit ms" << std::setw(10) << "asm MB"
+              << std::setw(9) << "ns/node" << std::setw(8) << "growth" << std::endl;
+    for (std::string_view shape : SYNTHETIC_SHAPES) {
+        double previous = 0;
+        for (size_t nodes = 1000; nodes <= maxNodes; nodes *= 10) {
+            size_t size;
+            std::string tree = syntheticTree(shape, nodes, size);
+
+            // Small programs are compiled repeatedly and the fastest run kept
+            size_t runs = std::max<size_t>(1, 100000 / size);
+            uint64_t best = UINT64_MAX;
+            uint64_t load = 0;
+            uint64_t emit = 0;
+            size_t bytes = 0;
+            for (size_t run = 0; run < runs; ++run) {
+                mergeStats();
+                g_stats = Stats();
+                CountingBuffer buffer;
+                std::ostream output(&buffer);
+                auto start = std::chrono::steady_clock::now();
+                compile(tree, output);
+                uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+                mergeStats();
+                if (elapsed < best) {
+                    best = elapsed;
+                    load = g_stats.phases[LOAD].nanoseconds;
+                    emit = g_stats.phases[OUTPUT].nanoseconds;
+                    bytes = buffer.count;
+                }
+            }
+
+            double perNode = static_cast<double>(best) / size;
+            std::cout << std::left << std::setw(12) << shape << std::right << std::setw(10) << size << std::fixed
+                      << std::setprecision(2) << std::setw(11) << load / 1e6 << std::setw(11)
+                      << (best - load - emit) / 1e6 << std::setw(11) << emit / 1e6 << std::setw(10) << bytes / 1e6
+                      << std::setprecision(0) << std::setw(9) << perNode << std::setprecision(2) << std::setw(8);
+            if (previous > 0) std::cout << perNode / previous;
+            else std::cout << "";
+            std::cout << std::endl;
+            previous = perNode;
+        }
+    }
+    g_stats = Stats();
     return 0;
 }
+
+int main(int argc, char* argv[]) {
+    // Static initialization has interned the grammar and keywords, which
+    // every compile shares; the rest is dropped after each one
+    g_strings.mark();
+
+    const char* path = nullptr;
+    std::string batch;
+    std::string server;
+    bool toBinary = false;
+    bool toText = false;
+    std::string synth;
+    size_t bench = 0;
+    bool run = false;
+    bool runArray = false;
+    std::vector<int32_t> runValues;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--no-peephole") {
+            g_options.peephole = false;
+        } else if (arg == "--no-register-args") {
+            g_options.registerArgs = false;
+        } else if (arg == "--no-licm") {
+            g_options.licm = false;
+        } else if (arg == "--stats" || arg == "--stats=text" || arg == "--stats=json") {
+            g_options.stats = arg == "--stats=json" ? "json" : "text";
+            g_options.timeOutput = true;
+            g_options.nodeStats = true;
+        } else if (arg == "--merl") {
+            g_options.merl = true;
+        } else if (arg.substr(0, 6) == "--run=") {
+            // --run=twoints:A,B or --run=array:V1,V2,...
+            std::string_view mode = arg.substr(6, arg.find(':') - 6);
+            if (mode != "twoints" && mode != "array") {
+                std::cerr << "ERROR: bad run mode " << mode << std::endl;
+                return 1;
+            }
+            run = true;
+            runArray = mode == "array";
+            std::vector<std::string_view> values;
+            if (arg.find(':') != std::string_view::npos) splitString(arg.substr(arg.find(':') + 1), values, ',');
+            for (std::string_view value : values) {
+                try {
+                    runValues.push_back(std::stoi(std::string(value)));
+                } catch (const std::exception& e) {
+                    std::cerr << "ERROR: bad input value " << value << std::endl;
+                    return 1;
+                }
+            }
+        } else if (arg == "--to-binary") {
+            toBinary = true;
+        } else if (arg == "--to-text") {
+            toText = true;
+        } else if (arg.substr(0, 8) == "--synth=") {
+            // --synth=SHAPE:NODES
+            synth = arg.substr(8);
+        } else if (arg == "--bench") {
+            bench = 10000000;
+        } else if (arg.substr(0, 8) == "--bench=") {
+            try {
+                bench = std::stoul(std::string(arg.substr(8)));
+            } catch (const std::exception& e) {
+                std::cerr << "ERROR: bad node count " << arg.substr(8) << std::endl;
+                return 1;
+            }
+        } else if (arg.substr(0, 8) == "--batch=") {
+            batch = arg.substr(8);
+        } else if (arg.substr(0, 9) == "--server=") {
+            server = arg.substr(9);
+        } else if (arg.substr(0, 8) == "--cache=") {
+            g_options.cacheDir = arg.substr(8);
+        } else if (arg.substr(0, 7) == "--jobs=") {
+            try {
+                g_options.jobs = std::max(1ul, std::stoul(std::string(arg.substr(7))));
+            } catch (const std::exception& e) {
+                std::cerr << "ERROR: bad job count " << arg.substr(7) << std::endl;
+                return 1;
+            }
+        } else if (arg.substr(0, 16) == "--inline-budget=") {
+            try {
+                g_options.inlineBudget = std::stoul(std::string(arg.substr(16)));
+            } catch (const std::exception& e) {
+                std::cerr << "ERROR: bad inline budget " << arg.substr(16) << std::endl;
+                return 1;
+            }
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            std::cerr << "ERROR: unknown option " << arg << std::endl;
+            return 1;
+        } else {
+            path = argv[i];
+        }
+    }
+
+    auto finish = [](int status) {
+        if (!g_options.stats.empty()) reportStats(std::cerr);
+        return status;
+    };
+    if (!g_options.cacheDir.empty() && !openCache()) return 1;
+    if (!batch.empty()) return finish(runBatch(batch));
+    if (!server.empty()) return runServer(server);
+    if (bench > 0) return runBench(bench);
+    if (!synth.empty()) {
+        size_t colon = synth.find(':');
+        size_t nodes = 0;
+        try {
+            if (colon != std::string::npos) nodes = std::stoul(synth.substr(colon + 1));
+        } catch (const std::exception& e) {
+        }
+        if (nodes == 0) {
+            std::cerr << "ERROR: bad synthetic program " << synth << std::endl;
+            return 1;
+        }
+        size_t size;
+        std::cout << syntheticTree(synth.substr(0, colon), nodes, size);
+        return 0;
+    }
+
+    // Read the program from the file named on the command line, or from stdin
+    int fd = 0;
+    if (path) {
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "ERROR: could not open " << path << std::endl;
+            return 1;
+        }
+    }
+    InputBuffer input(fd);
+    if (fd != 0) close(fd);
+
+    if (toBinary) {
+        writeBinaryTree(loadTree(input.view()), std::cout);
+        return finish(0);
+    }
+    if (toText) {
+        writeTextTree(loadTree(input.view()), std::cout);
+        return finish(0);
+    }
+    if (run) return finish(runProgram(input.view(), runArray, runValues));
+    compile(input.view(), std::cout);
+    return finish(0);
+}